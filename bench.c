@@ -0,0 +1,203 @@
+// Benchmarks for the heap.
+// Build with
+//   gcc -O2 -pthread bench.c heap.c -o bench
+// and run a benchmark by name, with the heap's knobs in the environment:
+//   ./bench chase [MiB]            pointer chasing over MiB of small nodes
+//   HEAP_THP=1 ./bench chase [MiB] the same, with huge page backed heaps
+//   ./bench batch [n] [bytes]      n blocks at a time, one by one vs batched
+//   ./bench merge [n]              n 30 MiB neighbors freed in order (exits 1 on failure)
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "heap.h"
+
+#define B_NODE 64	// bytes per node, one cache line
+#define B_HOPS 20000000	// hops timed per run
+#define B_BLOCKS 20000000	// blocks allocated and freed per timed run
+#define B_BIG (30<<20)		// bytes per block in b_merge, just under H_MMAPMAX
+
+typedef struct node {
+  struct node *next;
+  char pad[B_NODE - sizeof(struct node *)];
+} node;
+
+static void *volatile Sink; // keeps timed loops from being optimized away
+
+/*
+ * b_now().
+ * Return the time in ns.
+ */
+static double b_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/*
+ * b_rand(s).
+ * Return the next value of xorshift generator s.
+ */
+static unsigned long b_rand(unsigned long *s)
+{
+  *s ^= *s << 13;
+  *s ^= *s >> 7;
+  *s ^= *s << 17;
+  return *s;
+}
+
+/*
+ * b_thp().
+ * Return the kB of anonymous memory backed by transparent huge pages.
+ */
+static long b_thp(void)
+{
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  long kb = -1;
+  if (!f) return -1;
+  while (fgets(line, sizeof line, f)) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) break;
+  }
+  fclose(f);
+  return kb;
+}
+
+/*
+ * b_chase(mib).
+ * Link mib MiB of hmalloc'd nodes into one cycle in random order and time
+ * a walk around it.  Nearly every hop lands on a different page, so the
+ * walk is bound by TLB misses once the nodes outgrow the TLB's reach.
+ */
+static int b_chase(long mib)
+{
+  long n = (mib << 20) / B_NODE, i;
+  if (n < 2) return 2;
+  node **v = malloc(n * sizeof(node *));
+  if (!v) return 1;
+  for (i = 0; i < n; i++) {
+    v[i] = hmalloc(sizeof(node));
+    if (!v[i]) {
+      fprintf(stderr, "hmalloc failed after %ld nodes\n", i);
+      return 1;
+    }
+  }
+  unsigned long s = 88172645463325252UL;
+  for (i = n-1; i > 0; i--) { // shuffle
+    long j = b_rand(&s) % (i+1);
+    node *t = v[i]; v[i] = v[j]; v[j] = t;
+  }
+  for (i = 0; i < n; i++) v[i]->next = v[(i+1) % n];
+
+  node *p = v[0];
+  for (i = 0; i < n; i++) p = p->next; // warm up
+  double t0 = b_now();
+  for (i = 0; i < B_HOPS; i++) p = p->next;
+  double t1 = b_now();
+  Sink = p;
+
+  printf("chase: %ld MiB, %ld nodes, %.2f ns/hop, AnonHugePages %ld kB\n",
+	 mib, n, (t1-t0)/B_HOPS, b_thp());
+  for (i = 0; i < n; i++) hfree(v[i]);
+  free(v);
+  return 0;
+}
+
+/*
+ * b_batch(n,size).
+ * Allocate n blocks of size bytes and free them in random order, over and
+ * over, first with hmalloc and hfree one block at a time and then with
+ * hmalloc_batch and hfree_batch, and time both per block.
+ */
+static int b_batch(int n, size_t size)
+{
+  if (n < 1) return 2;
+  void **v = malloc(n * sizeof(void *)), **w = malloc(n * sizeof(void *));
+  long *order = malloc(n * sizeof(long));
+  if (!v || !w || !order) return 1;
+  long rounds = B_BLOCKS / n + 1, r;
+  int i;
+  unsigned long s = 88172645463325252UL;
+  for (i = 0; i < n; i++) order[i] = i;
+  for (i = n-1; i > 0; i--) { // shuffle
+    long j = b_rand(&s) % (i+1), t = order[i];
+    order[i] = order[j]; order[j] = t;
+  }
+
+  double t0 = b_now();
+  for (r = 0; r < rounds; r++) {
+    for (i = 0; i < n; i++) v[i] = hmalloc(size);
+    Sink = v[n-1];
+    for (i = 0; i < n; i++) hfree(v[order[i]]);
+  }
+  double t1 = b_now();
+  for (r = 0; r < rounds; r++) {
+    if (hmalloc_batch(size, n, w) < n) {
+      fprintf(stderr, "hmalloc_batch came up short\n");
+      return 1;
+    }
+    Sink = w[n-1];
+    for (i = 0; i < n; i++) v[i] = w[order[i]]; // the same order as above
+    hfree_batch(v, n);
+  }
+  double t2 = b_now();
+
+  printf("batch: %d blocks of %zu bytes, %.2f ns/block one by one, %.2f ns/block batched\n",
+	 n, size, (t1-t0)/(rounds*n), (t2-t1)/(rounds*n));
+  free(order);
+  free(w);
+  free(v);
+  return 0;
+}
+
+/*
+ * b_merge(n).
+ * Allocate n B_BIG blocks from the heap, free them in address order so each
+ * merges with the one before, and do it again.  Past 2 GiB the merged free
+ * chunk would outgrow a chunk header, so this also checks that merging
+ * stops at the heap's largest chunk.
+ */
+static int b_merge(int n)
+{
+  if (n < 1) return 2;
+  void **v = malloc(n * sizeof(void *));
+  if (!v) return 1;
+  hfree(hmalloc(B_BIG)); // raises the mmap threshold past B_BIG
+  double t = 0;
+  int r, i;
+  for (r = 0; r < 2; r++) {
+    for (i = 0; i < n; i++) {
+      v[i] = hmalloc(B_BIG);
+      if (!v[i]) {
+	fprintf(stderr, "hmalloc failed after %d blocks\n", i);
+	return 1;
+      }
+      memset(v[i], r, 4096);
+    }
+    double t0 = b_now();
+    for (i = 0; i < n; i++) hfree(v[i]);
+    t += b_now() - t0;
+  }
+  struct hstat st;
+  hstats(&st);
+  printf("merge: %d blocks of %d MiB, %.2f us/free, %ld merges\n",
+	 n, B_BIG >> 20, t/(2*n)/1e3, st.merges);
+  free(v);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc > 1 && !strcmp(argv[1], "chase")) {
+    return b_chase(argc > 2 ? atol(argv[2]) : 1024);
+  }
+  if (argc > 1 && !strcmp(argv[1], "batch")) {
+    return b_batch(argc > 2 ? atoi(argv[2]) : 64, argc > 3 ? atol(argv[3]) : 48);
+  }
+  if (argc > 1 && !strcmp(argv[1], "merge")) {
+    return b_merge(argc > 2 ? atoi(argv[2]) : 90);
+  }
+  fprintf(stderr, "usage: %s chase [MiB] | batch [n] [bytes] | merge [n]\n", argv[0]);
+  return 2;
+}
@@ -1,10 +1,26 @@
 // Implementation of heaps.
 // (c) The Great Class of 2015, especially <Kelly Wang>
+#define _GNU_SOURCE // for mremap
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__linux__) && defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#define H_RSEQ 1	// per-CPU caches are available (see pc_push/pc_pop)
+#endif
 #include "heap.h"
 
 /*
@@ -19,6 +35,7 @@ typedef int info;
 /* chunk: basic unit of allocation.
  * User gets payload when chunk is allocated.
  * When not allocated, payload stores double links into a list of free chunks.
+ * Only free chunks have a footer; an allocated chunk's payload runs to its end.
  */
 typedef struct chunk chunk;
 struct __attribute__((__packed__)) chunk {
@@ -27,6 +44,31 @@ struct __attribute__((__packed__)) chunk {
   chunk *prev;
   chunk *next;
   // :end of payload
+  // info footer;  (free chunks only)
+};
+
+/* tchunk: a large free chunk, kept in a size-ordered red-black tree.
+ * The tree links live in the payload after prev/next, so a tchunk is just
+ * a chunk whose payload is big enough to hold them.  Only one chunk of
+ * each size is a tree node; others of that size hang off it on the ring
+ * formed by prev/next, and are marked H_CHAINED.
+ */
+typedef struct tchunk tchunk;
+struct __attribute__((__packed__)) tchunk {
+  info header;
+  // payload starts here:
+  chunk *prev;     // ring of chunks with the same size
+  chunk *next;
+  tchunk *left;    // smaller sizes
+  tchunk *right;   // larger sizes
+  tchunk *parent;  // 0 at the root
+  int color;       // H_RED, H_BLACK or H_CHAINED
+  // free chunks of H_PURGEMIN bytes or more (see Purging) also hold:
+  int purged;      // H_DIRTY, H_ZEROED or H_LAZY
+  long stamp;      // when it last became dirty, in ms
+  tchunk *older;   // ring of an arena's dirty chunks
+  tchunk *newer;
+  // ...
   // info footer;
 };
 
@@ -34,25 +76,38 @@ struct __attribute__((__packed__)) chunk {
  * Sizes of things.
  * This code works on systems where H_PS is 8, and H_IS is 4.
  * It will not port if H_IS*2 != H_PS without some redesign.
+ * Payloads are aligned to H_ALIGN (alignof(max_align_t)): chunk sizes are
+ * multiples of H_ALIGN, and every chunk header sits H_IS bytes below an
+ * H_ALIGN boundary.  A segment (or a mapped chunk's mapping) starts on an
+ * H_ALIGN boundary, so its first chunk starts H_LEAD bytes in.
  */
 #define H_PS            (sizeof(void*)) //pointer
 #define H_IS            (sizeof(info))  //info tag (size of chunk + flags)
-#define H_MINPAYLOAD	(2*H_PS)
-#define H_MINCHUNK	(H_MINPAYLOAD+2*H_IS)
+#define H_ALIGN		16
+#define H_LEAD		(H_ALIGN-H_IS)
+#define H_MINCHUNK	((2*H_PS+2*H_IS+H_ALIGN-1)/H_ALIGN*H_ALIGN) // holds the links
+#define H_MINPAYLOAD	(H_MINCHUNK-H_IS)
 
 /*
  * information described in headers and footers:
- * size (always a multiple of 8), with low 3 bits representing up to 3 flags
+ * size (always a multiple of H_ALIGN), with low 4 bits representing up to 4 flags
+ * Footers are written on free chunks only, so a chunk's header carries
+ * H_PREVFREE when the chunk before it is free, and its footer may be read.
+ * The first chunk of a segment carries H_PREVFREE too: the base dummy (0)
+ * poses as the footer of a chunk that isn't free, and that is how a chunk
+ * that fills its segment is recognized.  The top dummy carries H_PREVFREE
+ * when the last chunk is free, so it is a dummy whenever its size is 0.
  */
 #define H_FREE 0x1
-// others would be declared as 0x2 and 0x4
+#define H_PREVFREE 0x8
+// others are declared as 0x2 (H_NONMAIN) and 0x4 (H_MMAP)
 
 /*
- * Sizes will always be a multiple of 8.
- * Therefore, the bottom three bits are useful as flags.
+ * Sizes will always be a multiple of H_ALIGN.
+ * Therefore, the bottom four bits are useful as flags.
  * Use this mask to determine the number of bytes in the associated chunk.
  */
-#define H_SIZEMASK (~0x7)
+#define H_SIZEMASK (~0xF)
 
 /*
  * Pointer manipulation macros.
@@ -61,17 +116,361 @@ struct __attribute__((__packed__)) chunk {
 #define PTR_ADD(p,i) (((char*)p)+(i))
 #define PTR_DIFF(a,b) (((char*)a)-(char*)b)
 
+/*
+ * Size-class bins.
+ * Free chunks are kept in an array of circular lists, one per size class.
+ * Chunks smaller than H_SMALLMAX bytes live in exact bins (one size per bin),
+ * so any chunk in a small bin fits any request that maps to that bin.
+ * Larger chunks are log-spaced: each power of two is split into H_LGSUB bins.
+ * BinMap has a bit set for every non-empty bin so empty ones are skipped.
+ */
+#define H_SMALLMAX	512
+#define H_NSMALL	(H_SMALLMAX/H_ALIGN)
+#define H_LGSUB		4
+#define H_LGBASE	9		// log2(H_SMALLMAX)
+#define H_NBINS		(H_NSMALL+(H_TREELOG-H_LGBASE)*H_LGSUB)
+#define H_MAPWORDS	((H_NBINS+63)/64)
+
+/*
+ * Chunks of H_TREEMIN bytes or more are not binned: they are kept in a
+ * red-black tree ordered by size, so an exact best fit costs O(log n).
+ */
+#define H_TREELOG	12
+#define H_TREEMIN	(1<<H_TREELOG)
+#define H_BLACK		0
+#define H_RED		1
+#define H_CHAINED	2
+
+/*
+ * Two-Level Segregated Fit (TLSF) index, the alternative placement engine.
+ * The first level splits sizes into power-of-two ranges; the second level
+ * splits each range into H_TLSL equal subranges.  A bitmap at each level
+ * records non-empty lists, so finding a list that is guaranteed to fit
+ * a request takes two find-first-set instructions, whatever the heap holds.
+ * Sizes below H_TLSMALL share first-level list 0, split linearly.
+ */
+#define H_TLSLLOG	4
+#define H_TLSL		(1<<H_TLSLLOG)
+#define H_TLSHIFT	(H_TLSLLOG+4)	// sizes are multiples of H_ALIGN
+#define H_TLSMALL	(1<<H_TLSHIFT)
+#define H_TLFL		(31-H_TLSHIFT+1)
+
+/*
+ * Fast bins.
+ * Freed chunks of up to H_FASTMAX bytes are not coalesced right away: each
+ * arena keeps them, still marked allocated, on singly linked LIFO lists of
+ * exactly one chunk size, so a request of that size pops one in a few
+ * instructions.  ar_consolidate merges them back into the free lists when a
+ * larger request can't otherwise be met, or when more than H_FASTLIMIT
+ * bytes are sitting in fast bins.
+ */
+#define H_FASTMAX	128
+#define H_NFAST		(H_FASTMAX/H_ALIGN+1)	// indexed by chunk size/H_ALIGN
+#define H_FASTLIMIT	(64<<10)
+
+/*
+ * Slabs.
+ * With HEAP_SLAB set, requests of up to H_SLABMAX bytes are served from
+ * slabs: H_SLABSIZE-byte blocks of memory, aligned to their size, that each
+ * hold objects of a single size class (a multiple of 16) with no per-object
+ * header at all.  A slab's header records its owner and class, and a bitmap
+ * with a bit set for every free object, so allocating or freeing an object
+ * is a bit flip.  All slabs are carved from one reserved range of address
+ * space, SlabBase...SlabEnd, so a pointer is recognized by a range check.
+ * An object handed to the caches poses as the chunk H_IS bytes before it.
+ */
+#define H_SLABSIZE	(16<<10)	// four 4 KiB pages
+#define H_SLABSPACE	(1UL<<32)	// address space reserved for slabs
+#define H_SLABMAX	1024
+#define H_NSLABCLS	(H_SLABMAX/16)
+#define H_SLABWORDS	(H_SLABSIZE/16/64)
+
+typedef struct slab slab;
+struct slab {
+  struct arena *ar;          // arena that owns this slab
+  slab *prev;                // neighbors on the arena's partial list
+  slab *next;
+  int size;                  // object size
+  int nobj;                  // objects in the slab
+  int nfree;                 // free objects
+  int first;                 // offset of the first object
+  unsigned long map[H_SLABWORDS] __attribute__((aligned(16))); // bit set => free
+};
+#define SL_OWNS(p) ((char*)(p) >= SlabBase && (char*)(p) < SlabEnd)
+#define SL_OF(p)   ((slab*)((uintptr_t)(p) & ~(uintptr_t)(H_SLABSIZE-1)))
+
+/*
+ * Arenas.
+ * The heap is split into independent arenas, each with its own lock and
+ * free lists, so threads assigned to different arenas never contend.
+ * Arena 0 (Main) grows inside one large PROT_NONE reservation made at init,
+ * committing pages with mprotect: BASE...HWM is the range of space alloced
+ * for its use, contiguous whatever else moves the program break, and
+ * MN_OWNS tells its chunks by address.  If the reservation can't be made
+ * (or HEAP_RESERVE is 0), Main grows with sbrk instead, and BASE...HWM may
+ * hold others' memory too.
+ * Every other arena grows inside H_HEAPMAX-byte regions obtained from mmap
+ * and aligned to H_HEAPMAX, each starting with an hheap that names its arena.
+ * Chunks in those regions carry H_NONMAIN, so hfree finds the owning arena
+ * by masking the chunk address.
+ * With HEAP_REMOTE set, a thread freeing a chunk of some other arena pushes
+ * it on that arena's remote queue (lock-free, many producers, one consumer)
+ * instead of taking its lock; whichever thread next takes the arena's lock
+ * on a slow path drains the queue in one go.
+ * In each arena, bins are the free lists, indexed by fl_bin; binMap tracks
+ * which are non-empty.  treeRoot is the tree of free chunks too large for
+ * any bin.  tlsf holds the free lists instead when UseTlsf (HEAP_FIT=tlsf).
+ */
+#define H_NONMAIN	0x2		// chunk is in an mmap'd region (see hheap)
+#define H_HEAPMAX	(64<<20)	// size and alignment of an arena's region
+#define H_MAXARENAS	256
+#define H_BIGREQ	(H_HEAPMAX/2)	// larger requests always go to Main
+#define H_RESERVE	(64L<<30)	// address space reserved for Main
+#define MN_OWNS(p) ((char*)(p) >= (char*)BASE && (char*)(p) < MainEnd)
+
+typedef struct hheap hheap;
+typedef struct arena arena;
+struct arena {
+  pthread_mutex_t lock;      // protects everything below
+  int index;                 // position in Arenas
+  void *base;                // Main only: pointer to first byte allocated
+  void *hwm;                 // Main only: first byte not allocated
+  hheap *heap;               // others: newest region, linked through prev
+  chunk bins[H_NBINS];       // the free lists, one per size class
+  unsigned long binMap[H_MAPWORDS]; // bit i set => bins[i] non-empty
+  tchunk *treeRoot;          // large free chunks, ordered by size
+  chunk tlsf[H_TLFL][H_TLSL]; // TLSF free lists
+  unsigned tlsfFL;           // bit f set => some tlsf[f][*] non-empty
+  unsigned tlsfSL[H_TLFL];   // bit s of tlsfSL[f] set => tlsf[f][s] non-empty
+  slab *slabs[H_NSLABCLS];   // per class, slabs with free objects
+  chunk *fast[H_NFAST];      // fast bins, linked through next
+  int fastBytes;             // bytes held in fast bins
+  long merges;               // chunks coalesced with a free neighbor
+  tchunk *dirty;             // oldest dirty chunk of H_PURGEMIN or more
+  int ticks;                 // frees since the last purge
+  long purged;               // bytes dropped by the purger
+  long grows;                // times space was taken from the system
+  long requested;            // bytes taken from the system
+  char *zeroLo, *zeroHi;     // known-zero range of heap_alloc's last chunk
+  // on its own cache line, so remote frees don't disturb the fields above:
+  _Atomic(chunk *) remote __attribute__((aligned(64))); // linked through next
+};
+
+struct hheap {
+  arena *ar;                 // arena that owns this region
+  hheap *prev;               // the arena's previous region
+  void *base;                // first byte used for segments
+  void *hwm;                 // first byte not allocated
+  void *end;                 // end of the region
+};
+// where a non-Main arena lives in its first region; arenas are cache aligned
+#define HP_ARENA(h)	((arena*)PTR_ADD(h, (sizeof(hheap)+63)/64*64))
+
+/*
+ * Segment registry.
+ * Every span the heap owns is recorded in Segs, sorted by base: each
+ * segment of an arena (base dummy to top dummy) and each mapped chunk.
+ * sg_find locates the span holding an address by binary search, so walkers
+ * needn't assume BASE...HWM is all ours, grow can tell whether new space
+ * follows one of its segments, and a segment that becomes wholly free can
+ * be released.  SegLock guards the table, and is only ever taken last.
+ */
+#define H_SEGINIT	256		// initial capacity of Segs
+
+typedef struct segment segment;
+struct segment {
+  char *base;                // first byte
+  char *end;                 // first byte past it
+  arena *ar;                 // owning arena, or 0 for a mapped chunk
+};
+
+/*
+ * Mapped chunks.
+ * Requests of MmapThreshold bytes or more get a private mapping each, so
+ * hfree can give them back with munmap whatever else is live.  The chunk
+ * carries H_MMAP and no size: its payload may exceed what an info holds,
+ * so the 64-bit mapping length sits in the H_PS bytes at H_LEAD before the
+ * chunk, and the info just before the header gives the chunk's offset into
+ * its mapping (H_LEAD, or more when the payload was placed for alignment).
+ * Heap chunks keep their compact header, and requests over H_CHUNKMAX
+ * bytes are always mapped.  Free heap chunks merge only while the result
+ * stays within H_CHUNKMAX bytes, so a chunk's size always fits its info;
+ * neighbors past that stay separate free chunks.  As in glibc, freeing a mapped chunk above the threshold
+ * raises the threshold past it (up to H_MMAPMAX), so buffers that are freed
+ * and requested again come from the heap rather than churning mappings.
+ * HEAP_MMAP_THRESHOLD fixes the threshold instead.
+ */
+#define H_MMAP		0x4		// chunk has a mapping of its own
+#define H_MMAPMIN	(128<<10)	// initial threshold
+#define H_MMAPMAX	(32<<20)	// the threshold never adapts above this
+#define H_CHUNKMAX	(1<<30)		// largest payload a heap chunk holds
+
+/*
+ * Batches.
+ * hmalloc_batch carves same-sized chunks side by side out of one chunk
+ * of up to H_BATCHBYTES at a time, under one lock.  hfree_batch frees each
+ * run of neighbors, as hmalloc_batch hands them out, as one chunk that is
+ * coalesced once.  It doesn't sort the pointers to find more runs: the sort
+ * costs more than the merges it saves.
+ */
+#define H_BATCHBYTES	(1<<20)
+
+/*
+ * Trimming.
+ * When a free makes the chunk touching the top of an arena's heap larger
+ * than TrimThreshold, the free pages above it are given back: Main decommits
+ * them (or lowers the break), other arenas lower their newest region's hwm
+ * and drop the pages.
+ * The threshold tracks twice MmapThreshold unless HEAP_TRIM_THRESHOLD sets it.
+ */
+#define H_TRIMMIN	(2*H_MMAPMIN)	// initial threshold
+
+/*
+ * Growth policy.
+ * Each time an arena grows it takes at least GrowPercent percent of its
+ * current size (but no less than H_GROWMIN and no more than GrowMax), so a
+ * heap that ramps up needs O(log n) extensions rather than one per request.
+ * Automatic trimming keeps the same amount free at the top, so a free
+ * doesn't just hand back what the next grow would take again.
+ * HEAP_GROW sets GrowPercent (0 grows by whole pages only);
+ * HEAP_GROW_MAX sets GrowMax.
+ */
+#define H_GROWMIN	(128<<10)
+#define H_GROWPCT	100
+#define H_GROWMAX	(8<<20)
+
+/*
+ * Purging.
+ * Large free chunks that have stayed dirty for PurgeDecay ms have their
+ * interior pages dropped with madvise, so they stop counting against RSS.
+ * The pages holding the header, links and footer are never dropped.
+ * Each arena rings its dirty chunks oldest first; every H_PURGETICK frees
+ * the slow path purges up to H_PURGEBATCH bytes of the expired ones, and
+ * with HEAP_PURGE_THREAD a background thread sweeps them as they expire.
+ * Chunks record whether their interior is known to be zero (fresh from the
+ * kernel, or dropped with MADV_DONTNEED), so hcalloc can skip clearing it.
+ * HEAP_DECAY sets PurgeDecay (negative disables purging); HEAP_PURGE=free
+ * uses the lazier MADV_FREE, whose pages aren't known to be zero.
+ */
+#define H_PURGEMIN	(32<<10)	// smallest chunk purged or tracked
+#define H_PURGETICK	64
+#define H_PURGEBATCH	(4<<20)
+#define H_DECAY		10000		// default PurgeDecay
+#define H_DIRTY		0		// pages may hold old data
+#define H_ZEROED	1		// interior pages read as zero
+#define H_LAZY		2		// interior pages dropped with MADV_FREE
+
+/*
+ * Huge pages.
+ * With HEAP_THP set, Main's reservation is aligned to H_HUGEPAGE and every
+ * heap is advised MADV_HUGEPAGE, so the kernel can back it with transparent
+ * huge pages.  Heaps then grow, trim and purge in whole huge pages
+ * (GrowUnit), so a purge never splits a huge page that is still in use.
+ * HEAP_THP=hugetlb also maps large mapped chunks with MAP_HUGETLB, falling
+ * back to ordinary pages when the pool is empty.
+ */
+#define H_HUGEPAGE	(2<<20)
+
 /*
  * Global state.
- * BASE...HWM is the range of space alloced for heap use.  
- * (May not be true if others call sbrk.)
- * PAGE_SIZE is useful with predicting the best values for sbrk.
- * FreeList
+ * PAGE_SIZE is useful with predicting the best values for growth.
+ * Arenas 1..NArenas-1 are created on first use; threads are assigned
+ * round-robin (HEAP_ARENAS overrides the default of twice the core count).
  */
-static void *BASE = 0;     // pointer to first byte allocated
-static void *HWM = 0;      // high water mark; first byte not allocated
+#define BASE (Main.base)
+#define HWM  (Main.hwm)
 static int PAGE_SIZE = 0;   // the default page size (likely 4096)
-static chunk FreeList[1];  // the free list
+static int GrowUnit = 0;    // heaps grow, trim and purge in multiples of this
+static int HugePages = 0;   // heaps are advised MADV_HUGEPAGE (HEAP_THP)
+static int UseHugetlb = 0;  // mapped chunks try MAP_HUGETLB (HEAP_THP=hugetlb)
+static int UseTlsf = 0;    // place chunks with TLSF rather than best fit
+static int UseRemote = 0;  // queue frees of other arenas' chunks
+static _Atomic int MmapThreshold = H_MMAPMIN; // smallest request mapped alone
+static int MmapFixed = 0;  // MmapThreshold was set by HEAP_MMAP_THRESHOLD
+static _Atomic long Mapped = 0; // bytes in mapped chunks
+static _Atomic int TrimThreshold = H_TRIMMIN; // free top chunks above this are trimmed
+static int TrimFixed = 0;  // TrimThreshold was set by HEAP_TRIM_THRESHOLD
+static int GrowPercent = H_GROWPCT; // least growth, as a percentage of the heap
+static int GrowMax = H_GROWMAX; // most growth beyond the request
+static int PurgeDecay = H_DECAY; // ms a chunk stays dirty before purging
+static int PurgeAdvice = MADV_DONTNEED; // or MADV_FREE (HEAP_PURGE=free)
+static char *SlabBase = 0; // reserved range for slabs (HEAP_SLAB)
+static char *SlabEnd = 0;
+static char *SlabTop = 0;  // first slab never handed out
+static slab *SlabFree = 0; // released slabs, linked through next
+static pthread_mutex_t SlabLock = PTHREAD_MUTEX_INITIALIZER; // guards the above
+static arena Main;         // the reserved (or sbrk) arena
+static char *MainEnd = 0;  // end of Main's reservation, or 0 when it uses sbrk
+static arena *Arenas[H_MAXARENAS]; // Arenas[0] is &Main
+static segment *Segs = 0;  // the registry, sorted by base
+static int NSegs = 0;
+static int SegCap = 0;
+static pthread_mutex_t SegLock = PTHREAD_MUTEX_INITIALIZER; // guards the above
+static int NArenas = 1;    // number of arenas threads are spread over
+static int NextArena = 0;  // next arena handed to a new thread
+
+/*
+ * Thread caches.
+ * Each thread keeps, per payload size class, a short stack of chunks it has
+ * recently freed.  Chunks stay marked allocated while cached, so hmalloc and
+ * hfree can pop and push them without taking a lock.  A thread's cache
+ * is refilled and flushed H_TCBATCH chunks at a time under arena locks, and is
+ * flushed entirely when the thread exits.
+ * Class i holds chunks with at least i*H_PS payload bytes.
+ */
+#define H_TCMAX		1024		// largest payload served from the cache
+#define H_TCLISTS	(H_TCMAX/8+1)	// see tc_class
+#define H_TCBATCH	16		// chunks moved per refill or flush
+#define H_TCCOUNT	64		// most chunks cached per class
+
+typedef struct tcache tcache;
+struct tcache {
+  chunk *list[H_TCLISTS];  // singly linked through next
+  int count[H_TCLISTS];
+  int state;               // TC_NEW, TC_LIVE or TC_DEAD
+};
+#define TC_NEW  0          // not yet registered for flushing at thread exit
+#define TC_LIVE 1
+#define TC_DEAD 2          // flushed at thread exit; bypass from now on
+
+/*
+ * Per-CPU caches.
+ * With HEAP_RSEQ set, small chunks are cached per CPU instead of per thread,
+ * so cached memory is bounded by the core count however many threads run.
+ * Each class on each CPU is an array of up to H_PCCAP chunks; pushes and pops
+ * run as Linux restartable sequences whose single committing store is to
+ * top, so they need no atomics.  A thread whose rseq area isn't registered
+ * falls back to its thread cache.
+ */
+#define H_PCCAP		32		// most chunks cached per class per CPU
+
+typedef struct pcpu pcpu;
+struct pcpu {
+  long top[H_TCLISTS];                 // number of chunks in each class
+  chunk *slot[H_TCLISTS][H_PCCAP];     // the chunks, oldest first
+};
+#define PC_UNKNOWN 0       // rseq area not looked up yet
+#define PC_LIVE    1
+#define PC_NONE    2       // no rseq for this thread; use the thread cache
+
+/*
+ * Synchronization.
+ * Each arena's lock protects its state; ArenaLock protects Arenas and
+ * NextArena.  Only the thread caches are touched without a lock.
+ */
+static pthread_once_t InitOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t ArenaLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t TcKey;     // runs tc_release as each thread exits
+static __thread tcache TCache;  // this thread's cache
+static __thread arena *MyArena; // this thread's arena
+static int UseRseq = 0;         // cache per CPU rather than per thread
+static int NCpus = 0;           // number of pcpu entries in PCpu
+static pcpu *PCpu = 0;          // per-CPU caches, indexed by cpu_id
+#ifdef H_RSEQ
+static __thread struct rseq *MyRseq;  // this thread's rseq area
+static __thread int PcState;          // PC_UNKNOWN, PC_LIVE or PC_NONE
+static __thread struct rseq OwnRseq __attribute__((aligned(32))); // if glibc has none
+#endif
 
 /*
  * A quick macro that is turned on if you set DEBUG environment variable
@@ -84,78 +483,610 @@ static int debug = 0;      // by default, don't debug
  * STUDENTS: please write hmalloc, hfree, and all methods marked with <== below
  **/
 static void   init(void);
-static chunk   *grow(int, chunk *);               // 
+static void   init_heap(void);
+static chunk   *grow(arena *, int);               // 
+
+static void   ar_init(arena *);
+static arena *ar_create(int);
+static arena *ar_get(void);
+static arena *ar_nth(int);
+static arena *ar_of(chunk *);
+static void   ar_lock(arena *);
+static void   ar_pushRemote(arena *, chunk *);
+static void   ar_consolidate(arena *);
+static hheap *hp_map(arena *);
+static void  *hp_more(arena *, int);
+static void   hp_advise(void *, long);
+static chunk *hp_segment(arena *, void *, int);
+static chunk *hp_extend(arena *, void *, int);
+static int    hp_trim(arena *, int);
+static int    gr_step(arena *);
+
+static void   sg_add(void *, void *, arena *);
+static void   sg_remove(void *);
+static int    sg_find(void *, segment *);
+static int    sg_move(arena *, void *, void *);
+static int    sg_release(arena *, chunk *);
+
+static slab  *sl_new(arena *, int);
+static int    sl_findFree(slab *);
+static chunk *sl_alloc(arena *, int);
+static void   sl_free(arena *, chunk *);
+static size_t bk_usable(void *);
+
+static size_t mm_length(size_t, size_t);
+static chunk *mm_alloc(size_t, size_t);
+static void   mm_free(chunk *);
+static chunk *mm_resize(chunk *, size_t);
+static char  *mm_base(chunk *);
+static size_t mm_len(chunk *);
+
+static long   pg_now(void);
+static void   pg_mark(chunk *, int);
+static void   pg_link(arena *, tchunk *);
+static void   pg_unlink(arena *, tchunk *);
+static void   pg_range(chunk *, char **, char **);
+static void   pg_run(arena *, long);
+static void  *pg_thread(void *);
 
 static info  *ck_footerAddr(chunk *);
 static void   ck_setInfo(chunk *, info);
-static chunk *ck_split(chunk *c, int paysize);	// 
-static void   ck_merge(chunk *c1, chunk *c2);	// 
+static chunk *ck_split(arena *a, chunk *c, int paysize);	// 
+static chunk *ck_coalesce(arena *a, chunk *c);
 static int    ck_size(chunk *c);
 static int    ck_payloadSize(chunk *c);
+static int    ck_request(int paysize);
 
-static void   fl_insert(chunk *, chunk *);	// 
-static void   fl_remove(chunk *);	        // 
+static int    fl_bin(int size);
+static int    fl_nextBin(arena *a, int bin);
+static void   fl_insert(arena *, chunk *);		// 
+static void   fl_remove(arena *, chunk *);	        // 
 static int    fl_size(chunk *);
-static chunk *fl_findBestFit(chunk *, int);	// 
+static chunk *fl_bestInBin(arena *a, int bin, int size);
+static chunk *fl_findBestFit(arena *, int);		// 
+
+static void   tr_rotate(arena *a, tchunk *x, int left);
+static void   tr_replace(arena *a, tchunk *u, tchunk *v);
+static void   tr_insert(arena *, tchunk *);
+static void   tr_remove(arena *, tchunk *);
+static tchunk *tr_findBest(arena *a, int size);
+static void   tr_print(tchunk *t, int depth);
+
+static void   tl_mapping(int size, int *fl, int *sl);
+static void   tl_insert(arena *, chunk *);
+static void   tl_remove(arena *, chunk *);
+static chunk *tl_findFit(arena *a, int size);
+
+static chunk *heap_alloc(arena *, int);
+static void   heap_free(arena *, chunk *);
+static void   heap_release(arena *, chunk *);
+static int    heap_batch(arena *, int, int, void **);
+static int    heap_resize(arena *, chunk *, int);
+static chunk *heap_align(arena *, int, int);
+
+
+static int    tc_start(void);
+static int    tc_class(int);
+static int    tc_refill(int);
+static void   tc_flush(int, int);
+static void   tc_release(void *);
+
+static int    pc_start(void);
+static int    pc_push(int, chunk *);
+static chunk *pc_pop(int);
+static chunk *pc_refill(int);
+static void   pc_flush(int);
 
 static void   ck_print(chunk *c);
 static void   fl_print(void);
+static void   sl_print(slab *);
+static void   hp_print(void *, void *);
 static void   hprint(void);
 /*
  * init(void).
  * This function must be called to initialize the system.
- * It should:
- *   * set up the FreeList dummy node representing "no free chunks"
- *   * capture the PAGE_SIZE of the system
- *   * initialize the HWM and BASE pointer to point to the "program break"
- * Set in this way, the next allocation will trigger a grow => sbrk.
+ * Any number of threads may call it; init_heap runs exactly once.
  */
 void init(void)
 {
-  if (BASE != 0) return;
+  pthread_once(&InitOnce, init_heap);
+}
+
+/*
+ * init_heap(void).
+ * The one-time initialization behind init.
+ * It should:
+ *   * choose the placement engine (HEAP_FIT=tlsf selects TLSF)
+ *   * note whether cross-arena frees are queued (HEAP_REMOTE)
+ *   * reserve the slab range if small objects go in slabs (HEAP_SLAB)
+ *   * capture the PAGE_SIZE of the system, and the GrowUnit heaps grow in
+ *     (a huge page with HEAP_THP)
+ *   * set up the Main arena, whose HWM and BASE point to the start of its
+ *     GrowUnit-aligned reservation (or to the "program break", if it can't
+ *     be had)
+ *   * decide how many arenas threads are spread over
+ *   * map the per-CPU caches if HEAP_RSEQ asks for them
+ *   * create the key that flushes thread caches at thread exit
+ * Set in this way, the next allocation will trigger a grow.
+ */
+void init_heap(void)
+{
   debug = 0 != getenv("DEBUG"); // see getenv(3)
+  char *fit = getenv("HEAP_FIT");
+  UseTlsf = fit && !strcmp(fit, "tlsf");
+  UseRemote = 0 != getenv("HEAP_REMOTE");
+  char *mt = getenv("HEAP_MMAP_THRESHOLD");
+  if (mt) {
+    MmapThreshold = atoi(mt);
+    MmapFixed = 1;
+  }
+  char *tt = getenv("HEAP_TRIM_THRESHOLD");
+  if (tt) {
+    TrimThreshold = atoi(tt);
+    TrimFixed = 1;
+  }
+  char *gp = getenv("HEAP_GROW");
+  if (gp) GrowPercent = atoi(gp);
+  char *gm = getenv("HEAP_GROW_MAX");
+  if (gm) GrowMax = atoi(gm);
+  char *dc = getenv("HEAP_DECAY");
+  if (dc) PurgeDecay = atoi(dc);
+  char *th = getenv("HEAP_THP");
+  HugePages = th != 0;
+  UseHugetlb = th && !strcmp(th, "hugetlb");
+#ifdef MADV_FREE
+  char *pm = getenv("HEAP_PURGE");
+  if (pm && !strcmp(pm, "free")) PurgeAdvice = MADV_FREE;
+#endif
+  if (getenv("HEAP_SLAB")) {
+    char *m = mmap(0, H_SLABSPACE+H_SLABSIZE, PROT_READ|PROT_WRITE,
+		   MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (m != MAP_FAILED) {
+      SlabBase = SlabTop = (char*)(((uintptr_t)m + H_SLABSIZE-1) & ~(uintptr_t)(H_SLABSIZE-1));
+      SlabEnd = SlabBase + H_SLABSPACE;
+    }
+  }
+  PAGE_SIZE = getpagesize();
+  GrowUnit = HugePages ? H_HUGEPAGE : PAGE_SIZE;
+
+  ar_init(&Main);
+  Arenas[0] = &Main;
+
+  char *n = getenv("HEAP_ARENAS");
+  NArenas = n ? atoi(n) : 2*sysconf(_SC_NPROCESSORS_ONLN);
+  if (NArenas < 1) NArenas = 1;
+  if (NArenas > H_MAXARENAS) NArenas = H_MAXARENAS;
+
+#ifdef H_RSEQ
+  if (getenv("HEAP_RSEQ")) {
+    NCpus = sysconf(_SC_NPROCESSORS_CONF);
+    PCpu = mmap(0, NCpus*sizeof(pcpu), PROT_READ|PROT_WRITE,
+		MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    UseRseq = PCpu != MAP_FAILED;
+  }
+#endif
+
+  pthread_key_create(&TcKey, tc_release);
+
+  pthread_t t;
+  if (PurgeDecay >= 0 && getenv("HEAP_PURGE_THREAD") &&
+      !pthread_create(&t, 0, pg_thread, 0)) {
+    pthread_detach(t);
+  }
 
-  // set up dummy node in free list
-  FreeList->header = 0;      // 0 => DUMMY
-  FreeList->prev = FreeList;
-  FreeList->next = FreeList;
-  
   // HWM-BASE is total space allocated
-  HWM = BASE = sbrk(0); 
-  PAGE_SIZE = getpagesize();
+  long rs = H_RESERVE;
+  char *rv = getenv("HEAP_RESERVE");
+  if (rv) rs = atol(rv);
+  rs = (rs + GrowUnit-1)/GrowUnit*GrowUnit;
+  // over-reserve by a huge page, if need be, to align the start
+  long slop = HugePages ? H_HUGEPAGE : 0;
+  char *r = rs > 0 ? mmap(0, rs+slop, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0) : MAP_FAILED;
+  if (r != MAP_FAILED) {
+    char *m = r;
+    r = (char*)(((uintptr_t)m + GrowUnit-1) & ~(uintptr_t)(GrowUnit-1));
+    if (r > m) munmap(m, r-m);
+    if (slop > r-m) munmap(r+rs, slop-(r-m));
+    hp_advise(r, rs);
+    HWM = BASE = r;
+    MainEnd = PTR_ADD(r, rs);
+  } else {
+    HWM = BASE = sbrk(0); // read last: creating a thread may move the break
+  }
 }
 
 /*
- * grow(delta,FreeList).
- * Allocate one or more pages (at least delta bytes) and add chunk to FreeList.
+ * grow(a,delta).
+ * Allocate one or more pages (at least delta bytes) and add chunk to its bin.
+ * Main commits them from its reservation (or takes them from sbrk); other
+ * arenas from the top of their newest region, mapping a fresh region when
+ * it is full.  Pages that directly follow one of a's segments extend its
+ * last chunk rather than starting another segment.
  */
-chunk *grow (int delta, chunk *l)
-// pre: delta > H_MINCHUNK
-// post: space is allocated, encapsulated by a chunk, added to freelist l
-//       HWM is updated to reflect extent of new allocation
+chunk *grow (arena *a, int delta)
+// pre: delta > H_MINCHUNK, a->lock is held
+// post: space is allocated, encapsulated by a chunk, added to the free lists
+//       HWM (or the region's hwm) is updated to reflect extent of new allocation
+//       if no memory can be had, 0 is returned
 {
-  init(); 
-  delta = delta + 4*H_IS; //bring payload size up to chunk size from hmalloc
-  delta = (delta + PAGE_SIZE-1)/PAGE_SIZE*PAGE_SIZE; 
-  chunk *c = sbrk(delta); //c now points to prev program break
+  delta = ck_request(delta) + H_ALIGN; //chunk size from hmalloc, plus lead and top dummy
+  void *hwm = a == &Main ? HWM : a->heap->hwm;
+  int step = gr_step(a);
+  if (step > delta) {
+    if (a != &Main) { // don't abandon a region that still fits the request
+      int room = PTR_DIFF(a->heap->end, hwm);
+      if (room < step && room >= delta) step = room;
+    }
+    delta = step;
+  }
+  // end the heap on a GrowUnit boundary, so it grows in whole (huge) pages
+  delta = ((uintptr_t)hwm + delta + GrowUnit-1)/GrowUnit*GrowUnit - (uintptr_t)hwm;
+  void *m = hp_more(a, delta);
+  if (!m) return 0;
+  chunk *c = hp_extend(a, m, delta);
+  return c ? c : hp_segment(a, m, delta); // not contiguous
+}
 
-  HWM = sbrk(0); //returns end of the allocated space; new program break
-  
-  *(info*)c = 0; //thing c points to (dereferenced info pointer) is 0 - initialize top segment boundary
-  info* end = (info*)PTR_ADD(HWM, -H_IS); //subtract size of an info from HWM 
-  *end = 0; //initialize bottom segment boundary
+/*
+ * gr_step(a).
+ * Return the least arena a should grow by, following the growth policy.
+ */
+int gr_step(arena *a)
+// pre: a->lock is held
+// post: returns a multiple of GrowUnit, or 0 if GrowPercent is 0
+{
+  if (GrowPercent <= 0) return 0;
+  long size = a == &Main ? PTR_DIFF(HWM, BASE) : PTR_DIFF(a->heap->hwm, a->heap->base);
+  long step = size/100*GrowPercent;
+  if (step < H_GROWMIN) step = H_GROWMIN;
+  if (step > GrowMax) step = GrowMax;
+  return step/GrowUnit*GrowUnit;
+}
+
+/*
+ * hp_more(a,delta).
+ * Take delta more bytes from the top of arena a's heap.
+ */
+void *hp_more(arena *a, int delta)
+// pre: delta is a multiple of H_ALIGN (of PAGE_SIZE for Main), a->lock is held
+// post: returns the start of the new space and HWM (or the region's hwm)
+//       is moved past it; if no memory can be had, 0 is returned
+{
+  void *m;
+  if (a == &Main && MainEnd) { // commit the next pages of the reservation
+    if (PTR_DIFF(MainEnd, HWM) < delta || mprotect(HWM, delta, PROT_READ|PROT_WRITE)) return 0;
+    m = HWM;
+    HWM = PTR_ADD(HWM, delta);
+  } else if (a == &Main) {
+    int pad = -(uintptr_t)sbrk(0) & (H_ALIGN-1); // someone left the break unaligned
+    m = sbrk(pad + delta); //m now points to prev program break
+    if (m == (void*)-1) return 0;
+    m = PTR_ADD(m, pad);
+    HWM = sbrk(0); //returns end of the allocated space; new program break
+    hp_advise(m, delta);
+  } else {
+    hheap *h = a->heap;
+    if (PTR_DIFF(h->end, h->hwm) < delta) { // region full; start another
+      h = hp_map(a);
+      if (!h || PTR_DIFF(h->end, h->hwm) < delta) return 0;
+    }
+    m = h->hwm;
+    h->hwm = PTR_ADD(m, delta);
+  }
+  a->grows++;
+  a->requested += delta;
+  return m;
+}
+
+/*
+ * hp_advise(m,len).
+ * Ask for huge pages to back the len bytes at m, if HEAP_THP is set.
+ */
+void hp_advise(void *m, long len)
+// post: the whole pages of [m,m+len) are advised MADV_HUGEPAGE
+{
+#ifdef MADV_HUGEPAGE
+  if (!HugePages) return;
+  uintptr_t lo = ((uintptr_t)m + PAGE_SIZE-1) & ~(uintptr_t)(PAGE_SIZE-1);
+  uintptr_t hi = ((uintptr_t)m + len) & ~(uintptr_t)(PAGE_SIZE-1);
+  if (hi > lo) madvise((void*)lo, hi-lo, MADV_HUGEPAGE);
+#endif
+}
+
+/*
+ * hp_segment(a,m,delta).
+ * Bracket the delta bytes at m with boundaries and free the chunk between.
+ */
+chunk *hp_segment(arena *a, void *m, int delta)
+// pre: m is fresh space from hp_more, a->lock is held
+// post: returns the new free chunk, already in a's free lists
+{
+  info flags = a == &Main ? 0 : H_NONMAIN;
+  *(info*)PTR_ADD(m, H_LEAD-H_IS) = 0; //initialize base segment boundary, just below the first chunk
+  info* end = (info*)PTR_ADD(m, delta-H_IS); //last info in the new space
+  *end = 0; //initialize top segment boundary
 
-  c = (chunk*)PTR_ADD(c, H_IS); //increment c to point at where the chunk will start
+  chunk *c = (chunk*)PTR_ADD(m, H_LEAD); //c points at where the chunk will start
+  sg_add(m, PTR_ADD(m, delta), a);
 
   int size = PTR_DIFF(end, c); 
-  ck_setInfo(c, size|H_FREE);//set free bit 
+  ck_setInfo(c, size|H_FREE|H_PREVFREE|flags);//set free bit; PREVFREE marks it first
+  pg_mark(c, H_ZEROED); // fresh from the kernel
   
-  fl_insert(l, c);
+  fl_insert(a, c);
   
   return c;
   
 }
 
+/**
+ * Arena methods.
+ **/
+/*
+ * ar_init(a).
+ * Set up the lock and empty free lists of arena a.
+ */
+void ar_init(arena *a)
+// pre: a points to zeroed memory
+// post: a holds no chunks; each list has only its dummy node
+{
+  pthread_mutex_init(&a->lock, 0);
+  // set up dummy node in each bin
+  int b, s;
+  for (b = 0; b < H_NBINS; b++) {
+    a->bins[b].header = 0;      // 0 => DUMMY
+    a->bins[b].prev = &a->bins[b];
+    a->bins[b].next = &a->bins[b];
+  }
+  for (b = 0; b < H_TLFL; b++) {
+    for (s = 0; s < H_TLSL; s++) {
+      a->tlsf[b][s].header = 0;
+      a->tlsf[b][s].prev = &a->tlsf[b][s];
+      a->tlsf[b][s].next = &a->tlsf[b][s];
+    }
+  }
+}
+
+/*
+ * ar_create(i).
+ * Make arena i, placing it at the start of its first mmap'd region.
+ */
+arena *ar_create(int i)
+// pre: ArenaLock is held, Arenas[i] is 0
+// post: returns the new arena, or 0 if no memory could be mapped
+{
+  hheap *h = hp_map(0);
+  if (!h) return 0;
+  arena *a = HP_ARENA(h);
+  ar_init(a);
+  a->index = i;
+  a->heap = h;
+  h->ar = a;
+  h->base = h->hwm = PTR_ADD(a, (sizeof(arena)+H_ALIGN-1)/H_ALIGN*H_ALIGN); // segments follow a
+  return a;
+}
+
+/*
+ * ar_get().
+ * Find this thread's arena, assigning one round-robin on first use.
+ */
+arena *ar_get(void)
+// post: returns the arena this thread allocates from
+{
+  arena *a = MyArena;
+  if (a) return a;
+  pthread_mutex_lock(&ArenaLock);
+  int i = NextArena;
+  NextArena = (NextArena + 1) % NArenas;
+  if (!Arenas[i]) Arenas[i] = ar_create(i);
+  a = Arenas[i] ? Arenas[i] : &Main;
+  pthread_mutex_unlock(&ArenaLock);
+  return MyArena = a;
+}
+
+/*
+ * ar_nth(n).
+ * Return arena n, for walking all arenas.
+ */
+arena *ar_nth(int n)
+// post: returns Arenas[n], or 0 if it hasn't been created
+{
+  pthread_mutex_lock(&ArenaLock);
+  arena *a = Arenas[n];
+  pthread_mutex_unlock(&ArenaLock);
+  return a;
+}
+
+/*
+ * ar_of(c).
+ * Find the arena that owns chunk c.
+ */
+arena *ar_of(chunk *c)
+// pre: c is a valid chunk, or an object in a slab posing as one
+// post: returns its arena; needs no lock
+{
+  if (SL_OWNS(c)) return SL_OF(c)->ar;
+  if (MN_OWNS(c) || !(c->header & H_NONMAIN)) return &Main;
+  return ((hheap*)((uintptr_t)c & ~(uintptr_t)(H_HEAPMAX-1)))->ar;
+}
+
+/*
+ * ar_lock(a).
+ * Take arena a's lock for a slow-path operation, first freeing any chunks
+ * other threads have queued for it.
+ */
+void ar_lock(arena *a)
+// post: a->lock is held; a's remote queue has been drained
+{
+  pthread_mutex_lock(&a->lock);
+  if (atomic_load_explicit(&a->remote, memory_order_relaxed)) {
+    chunk *c = atomic_exchange_explicit(&a->remote, 0, memory_order_acquire);
+    while (c) {
+      chunk *next = c->next;
+      heap_free(a, c);
+      c = next;
+    }
+  }
+}
+
+/*
+ * ar_pushRemote(a,c).
+ * Queue chunk c to be freed by arena a, without blocking.
+ */
+void ar_pushRemote(arena *a, chunk *c)
+// pre: c is an allocated chunk of a
+// post: c is on a's remote queue
+{
+  chunk *head = atomic_load_explicit(&a->remote, memory_order_relaxed);
+  do {
+    c->next = head;
+  } while (!atomic_compare_exchange_weak_explicit(&a->remote, &head, c,
+		memory_order_release, memory_order_relaxed));
+}
+
+/*
+ * ar_consolidate(a).
+ * Empty a's fast bins, coalescing each chunk into the free lists.
+ */
+void ar_consolidate(arena *a)
+// pre: a->lock is held
+// post: a's fast bins are empty
+{
+  int i;
+  for (i = 0; i < H_NFAST; i++) {
+    chunk *c = a->fast[i];
+    a->fast[i] = 0;
+    while (c) {
+      chunk *next = c->next;
+      ck_setInfo(c, c->header|H_FREE);
+      chunk *m = ck_coalesce(a, c);
+      pg_mark(m, H_DIRTY);
+      fl_insert(a, m);
+      c = next;
+    }
+  }
+  a->fastBytes = 0;
+}
+
+/*
+ * hp_map(a).
+ * Map a fresh H_HEAPMAX-aligned region for arena a.
+ */
+hheap *hp_map(arena *a)
+// pre: a->lock is held (unless a is 0, for a region ar_create will claim)
+// post: returns the region, now a's newest, or 0 if mmap fails
+{
+  // over-map so an aligned region fits, then unmap the slop on either side
+  char *m = mmap(0, 2*H_HEAPMAX, PROT_READ|PROT_WRITE,
+		 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (m == MAP_FAILED) return 0;
+  char *r = (char*)(((uintptr_t)m + H_HEAPMAX-1) & ~(uintptr_t)(H_HEAPMAX-1));
+  if (r > m) munmap(m, r-m);
+  munmap(r+H_HEAPMAX, m+H_HEAPMAX-r);
+  hp_advise(r, H_HEAPMAX);
+
+  hheap *h = (hheap*)r;
+  h->ar = a;
+  h->base = h->hwm = PTR_ADD(h, (sizeof(hheap)+H_ALIGN-1)/H_ALIGN*H_ALIGN);
+  h->end = PTR_ADD(h, H_HEAPMAX);
+  if (a) {
+    h->prev = a->heap;
+    a->heap = h;
+  }
+  return h;
+}
+
+/*
+ * hp_extend(a,m,delta).
+ * If one of a's segments ends at m, move its top boundary to the end of the
+ * delta bytes at m, giving them to the last chunk if it is free (and stays
+ * within H_CHUNKMAX), or to a new chunk if not.
+ */
+chunk *hp_extend(arena *a, void *m, int delta)
+// pre: m is fresh space from hp_more, a->lock is held
+// post: returns the free chunk now touching the top, already in a's free lists,
+//       or 0 if no segment of a ends at m
+{
+  if (!sg_move(a, m, PTR_ADD(m, delta))) return 0;
+  info flags = a == &Main ? 0 : H_NONMAIN;
+  info *top = (info*)PTR_ADD(m, -H_IS); // the old top boundary
+  *(info*)PTR_ADD(m, delta-H_IS) = 0;   // the new one
+  chunk *c = 0;
+  int purged = H_ZEROED; // the new pages are fresh from the kernel
+  if (*top & H_PREVFREE) { // the last chunk is free; its footer precedes top
+    c = (chunk*)PTR_ADD(top, -(top[-1] & H_SIZEMASK));
+    if (ck_size(c) + delta > H_CHUNKMAX) c = 0; // too big to merge with
+  }
+  if (c) {
+    if (ck_size(c) < H_PURGEMIN || ((tchunk*)c)->purged != H_ZEROED) {
+      purged = H_DIRTY;
+    } else { // the tail below the old footer was never purged; the range will cover it
+      char *lo, *hi;
+      pg_range(c, &lo, &hi);
+      if (hi < (char*)(top-1)) memset(hi, 0, (char*)(top-1) - hi);
+    }
+    fl_remove(a, c);
+    top[-1] = *top = 0; // the old footer and top boundary are now interior
+    ck_setInfo(c, (ck_size(c)+delta)|H_FREE|flags|(c->header & H_PREVFREE));
+  } else {
+    c = (chunk*)top;
+    ck_setInfo(c, delta|H_FREE|flags|(*top & H_PREVFREE));
+  }
+  pg_mark(c, purged);
+  fl_insert(a, c);
+  return c;
+}
+
+/*
+ * hp_trim(a,pad).
+ * Give back whole pages of the free chunk at the top of a's heap,
+ * keeping at least pad bytes of it.
+ */
+int hp_trim(arena *a, int pad)
+// pre: a->lock is held
+// post: returns 1 if memory was released, 0 otherwise
+{
+  hheap *h = a->heap;
+  void *hwm = a == &Main ? HWM : h->hwm;
+  if (hwm == (a == &Main ? BASE : h->base)) return 0; // nothing grown yet
+  info *top = (info*)PTR_ADD(hwm, -H_IS);
+  if (!(*top & H_PREVFREE)) return 0; // the last chunk isn't free
+  chunk *c = (chunk*)PTR_ADD(top, -(top[-1] & H_SIZEMASK)); // from its footer
+  int size = ck_size(c);
+  // keep H_MINCHUNK+pad, ending the heap on a GrowUnit boundary
+  uintptr_t keep = (uintptr_t)PTR_ADD(c, H_MINCHUNK + pad + H_IS);
+  keep = (keep + GrowUnit-1)/GrowUnit*GrowUnit;
+  long extra = (uintptr_t)hwm > keep ? (uintptr_t)hwm - keep : 0;
+  if (extra <= 0) return 0;
+  if (a == &Main && !MainEnd && sbrk(0) != HWM) return 0; // someone else's memory is above ours
+  fl_remove(a, c); // while its links are still mapped
+  if (a == &Main && MainEnd) { // decommit: fresh PROT_NONE pages over the old
+    void *d = PTR_ADD(HWM, -extra);
+    if (mmap(d, extra, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0) == MAP_FAILED) {
+      fl_insert(a, c);
+      return 0;
+    }
+    hp_advise(d, extra); // the fresh mapping lost the advice
+    HWM = d;
+  } else if (a == &Main) {
+    if (sbrk(-extra) == (void*)-1) {
+      fl_insert(a, c);
+      return 0;
+    }
+    HWM = sbrk(0);
+  } else {
+    char *lo = (char*)(((uintptr_t)hwm - extra + PAGE_SIZE-1) & ~(uintptr_t)(PAGE_SIZE-1));
+    char *hi = (char*)(((uintptr_t)hwm + PAGE_SIZE-1) & ~(uintptr_t)(PAGE_SIZE-1)); // nothing above hwm is in use
+    if (hi > lo) madvise(lo, hi-lo, MADV_DONTNEED);
+    h->hwm = PTR_ADD(hwm, -extra);
+  }
+  sg_move(a, hwm, PTR_ADD(hwm, -extra));
+  *(info*)PTR_ADD(c, size-extra) = 0; // the new top boundary
+  ck_setInfo(c, (size-extra)|(c->header & (H_FREE|H_NONMAIN|H_PREVFREE)));
+  fl_insert(a, c);
+  return 1;
+}
+
 /*
  * ck_size(c).
  * Return the size of chunk c in bytes.
@@ -175,7 +1106,18 @@ int ck_payloadSize(chunk *c)
 // pre: c is a valid chunk, possibly free
 // post: returns the size of c's payload, in bytes (see ck_size for chunk size)
 {
-  return ck_size(c)-2*H_IS;
+  return ck_size(c)-H_IS; // no footer while allocated
+}
+
+/*
+ * ck_request(paysize).
+ * Return the size of the smallest chunk with at least paysize bytes of payload.
+ */
+int ck_request(int paysize)
+// post: returns a multiple of H_ALIGN, at least H_MINCHUNK
+{
+  int size = (paysize + H_IS + H_ALIGN-1)/H_ALIGN*H_ALIGN;
+  return size < H_MINCHUNK ? H_MINCHUNK : size;
 }
 
 /*
@@ -192,34 +1134,42 @@ info *ck_footerAddr(chunk *c)
 
 /*
  * ck_setInfo(c,i).
- * Set the header and footer info fields for this chunk to i.
+ * Set the header info field for this chunk to i, and its footer too if
+ * i marks it free.  The next chunk's H_PREVFREE is set to match.
  * The location of the footer depends on size which is computed from i.
  */
 void ck_setInfo(chunk *c, info i)
-// pre: c is a pointer to a chunk, possibly not initialize
-// post: set header and footer to i
+// pre: c is a pointer to a chunk, possibly not initialize; i carries c's own
+//      H_PREVFREE; unless c is mapped, the info after c is written
+// post: set header (and, if free, footer) to i, and the next H_PREVFREE
 {
   c->header = i;
-  info *foot = ck_footerAddr(c);
-  *foot = i;
+  if (i & H_MMAP) return; // nothing follows
+  info *next = (info*)PTR_ADD(c, i & H_SIZEMASK);
+  if (i & H_FREE) {
+    next[-1] = i; // the footer
+    *next |= H_PREVFREE;
+  } else {
+    *next &= ~H_PREVFREE;
+  }
 }
 
 /*
- * ck_split(c,paySize)
+ * ck_split(a,c,paySize)
  * Split a chunk, c, into two pieces: c and the return value, rest.
  */
-chunk *ck_split(chunk *c, int paysize)
-// pre: c is a chunk (not marked free), paysize is the desired payload size
+chunk *ck_split(arena *a, chunk *c, int paysize)
+// pre: c is a chunk (not marked free) in arena a, paysize is the desired payload size
 // post: c is trimmed appropriately and the remainder is returned as another chunk
 //       if chunk can't be split, 0 is returned.
 {
-  printf("ck_split entered!\n");
-
   //chunk can only be split if paysize big enough; this is an extra check even though hmalloc already takes care of this
   if (paysize >= H_MINPAYLOAD) {
     int CHUNK_SIZE = ck_size(c); //we'll need this later
-    paysize = (paysize + H_PS-1)/H_PS*H_PS; //round paysize up to multiple of 8
-    info size_c = paysize + 2*H_IS; //reset c's payload size
+    info flags = c->header & H_NONMAIN; //both pieces stay in c's arena
+    //a free c (just taken from the lists) passes its purge state on
+    int purged = (c->header & H_FREE) && CHUNK_SIZE >= H_PURGEMIN ? ((tchunk*)c)->purged : H_DIRTY;
+    info size_c = ck_request(paysize); //reset c's payload size, keeping d aligned
     
     info size_d = CHUNK_SIZE - size_c;
     
@@ -228,16 +1178,16 @@ chunk *ck_split(chunk *c, int paysize)
       return 0;
     } 
     
-    //trim c's payload by creating one chunk of size paysize + header and footer
-    ck_setInfo(c, size_c); 
+    //trim c's payload by creating one chunk of size paysize + header
+    ck_setInfo(c, size_c|flags|(c->header & H_PREVFREE)); 
 
-    //find where c ends
-    info *end_c = ck_footerAddr(c);
-    chunk *d = (chunk*)PTR_ADD(end_c, H_IS); //new chunk d starts where c ended
-    ck_setInfo(d, size_d|H_FREE); 
+    chunk *d = (chunk*)PTR_ADD(c, size_c); //new chunk d starts where c ended
+    ck_setInfo(d, size_d|H_FREE|flags); 
 	       
-    //insert it into the free list
-    fl_insert(FreeList, d);
+    //insert it into the free list, merged with a free successor
+    chunk *e = ck_coalesce(a, d);
+    pg_mark(e, ck_size(e) == size_d ? purged : H_DIRTY);
+    fl_insert(a, e);
     
     return d;
 
@@ -248,57 +1198,130 @@ chunk *ck_split(chunk *c, int paysize)
 }
 
 /*
- * ck_merge(c1,c2).
- * Merge neighboring free chunks together.
- * c1 and c2 are removed from the free list, merged into a single chunk
- * accessible by c1 and added back into the free list.
+ * ck_coalesce(a,c).
+ * Merge free chunk c with whichever of its neighbors are free, as long
+ * as the result holds no more than H_CHUNKMAX bytes.
+ * The boundary tags make this O(1): the next chunk's header follows c,
+ * and, when c's H_PREVFREE says there is one, the previous chunk's footer
+ * precedes it.  The 0 sentinels at each end of a segment are never free,
+ * so chunks never merge across segments.
  */
-void ck_merge(chunk *c1, chunk *c2)
-// pre: c1 and c2 are adjacent free chunks with c1 < c2
-// post: c2 is merged into c1 and the entire chunk is classified as free
+chunk *ck_coalesce(arena *a, chunk *c)
+// pre: c is marked free but is in no list
+// post: returns the merged chunk (c or its predecessor), marked free but in no list
 {
-  fl_remove(c1);
-  fl_remove(c2);
-  
-  chunk *sum = c1;
-  //merge c1 with c2; take sum of sizes
-  info totalSize = ck_size(c1) + ck_size(c2);
-  ck_setInfo(sum, totalSize|H_FREE);
-  
-  fl_insert(sum, FreeList);
-
+  info flags = c->header & H_NONMAIN;
+  int size = ck_size(c);
+  chunk *next = (chunk*)PTR_ADD(c, size);
+  if ((next->header & H_FREE) && size + ck_size(next) <= H_CHUNKMAX) {
+    fl_remove(a, next);
+    size += ck_size(next);
+    a->merges++;
+  }
+  info prevFoot = c->header & H_PREVFREE ? *(info*)PTR_ADD(c, -H_IS) : 0;
+  if ((prevFoot & H_FREE) && size + (prevFoot & H_SIZEMASK) <= H_CHUNKMAX) {
+    c = (chunk*)PTR_ADD(c, -(prevFoot & H_SIZEMASK));
+    fl_remove(a, c);
+    size += ck_size(c);
+    a->merges++;
+  }
+  ck_setInfo(c, size|H_FREE|flags|(c->header & H_PREVFREE));
+  return c;
 }
 
-
 /**
  * Free List methods.
  **/
 /*
- * fl_insert(l,c).
- * Insert chunk c into FreeList, l.
- * Different approaches to managing FreeList lead to different performance.
+ * fl_bin(size).
+ * Map a chunk size to the index of the bin that holds chunks of that size.
+ */
+int fl_bin(int size)
+// pre: size is a chunk size (a multiple of H_ALIGN, at least H_MINCHUNK), < H_TREEMIN
+// post: returns an index into a->bins; larger sizes never map to smaller bins
+{
+  if (size < H_SMALLMAX) {
+    return size/H_ALIGN; // exact bins
+  }
+  int lg = 31 - __builtin_clz(size); // floor(log2(size)), at least H_LGBASE
+  int sub = (size >> (lg - 2)) & (H_LGSUB-1); // next two bits pick the sub-bin
+  return H_NSMALL + (lg - H_LGBASE)*H_LGSUB + sub;
+}
+
+/*
+ * fl_nextBin(a,bin).
+ * Find the first non-empty bin at or above bin, using a->binMap.
  */
-void fl_insert(chunk *l, chunk *c)
-// pre: c not in l
-// post: c is added (to head) of l
+int fl_nextBin(arena *a, int bin)
+// pre: 0 <= bin
+// post: returns the index of a non-empty bin >= bin, or -1 if there is none
 {
+  int w = bin/64;
+  if (w >= H_MAPWORDS) return -1;
+  unsigned long bits = a->binMap[w] & (~0UL << (bin%64)); // ignore bins below
+  while (!bits) {
+    if (++w == H_MAPWORDS) return -1;
+    bits = a->binMap[w];
+  }
+  return w*64 + __builtin_ctzl(bits);
+}
+
+/*
+ * fl_insert(a,c).
+ * Insert free chunk c into the bin for its size.
+ * Different approaches to managing the bins lead to different performance.
+ */
+void fl_insert(arena *a, chunk *c)
+// pre: c not in a list
+// post: c is added (to head) of its bin, and the bin is marked non-empty
+{
+  if (ck_size(c) >= H_PURGEMIN && ((tchunk*)c)->purged == H_DIRTY && PurgeDecay >= 0) {
+    pg_link(a, (tchunk*)c);
+  }
+  if (UseTlsf) {
+    tl_insert(a, c);
+    return;
+  }
+  if (ck_size(c) >= H_TREEMIN) {
+    tr_insert(a, (tchunk*)c);
+    return;
+  }
+  int b = fl_bin(ck_size(c));
+  chunk *l = &a->bins[b];
   c->prev = l; //connect c's pointers
   c->next = l->next;
   l->next->prev = c; //chunk after l
   l->next = c; //connect l's pointer
+  a->binMap[b/64] |= 1UL << (b%64);
 }
 
 /*
- * fl_remove(c).
+ * fl_remove(a,c).
  * Remove chunk c from list.
  * Notice that we don't need to provide a list: c knows where it's located.
+ * If c was the last chunk in its bin, the bin is marked empty.
  */
-void fl_remove(chunk *c)
+void fl_remove(arena *a, chunk *c)
 // pre: c is in a list
 // post: c is removed from that list
 {
+  if (ck_size(c) >= H_PURGEMIN && ((tchunk*)c)->purged == H_DIRTY && PurgeDecay >= 0) {
+    pg_unlink(a, (tchunk*)c);
+  }
+  if (UseTlsf) {
+    tl_remove(a, c);
+    return;
+  }
+  if (ck_size(c) >= H_TREEMIN) {
+    tr_remove(a, (tchunk*)c);
+    return;
+  }
   c->prev->next = c->next;
   c->next->prev = c->prev;
+  if (c->prev == c->next && c->prev->header == 0) { // only the dummy is left
+    int b = c->prev - a->bins;
+    a->binMap[b/64] &= ~(1UL << (b%64));
+  }
 }
 
 /*
@@ -320,76 +1343,1425 @@ int fl_size(chunk *l)
 }
 
 /*
- * fl_findBestFit(l,size).
- * We look for element in list l that will best hold a size targetPayload payload.
+ * fl_bestInBin(a,bin,size).
+ * Scan one bin for the smallest chunk that is at least size bytes.
+ */
+chunk *fl_bestInBin(arena *a, int bin, int size)
+// pre: 0 <= bin < H_NBINS, size is a chunk size
+// post: returns the best fitting chunk in the bin, or 0 if none is big enough
+{
+  chunk *l = &a->bins[bin];
+  chunk *best = 0;
+  chunk *p;
+  for (p = l->next; p != l; p = p->next) {
+    int s = ck_size(p);
+    if (s == size) return p; // exact match; can't do better
+    if (s > size && (!best || s < ck_size(best))) best = p;
+  }
+  return best;
+}
+
+/*
+ * fl_findBestFit(a,size).
+ * We look for the free chunk that will best hold a size targetPayload payload.
+ * Small requests take the head of the first non-empty bin; medium requests
+ * scan at most their own bin and the next non-empty one; large requests
+ * (and anything the bins can't satisfy) search the tree.
+ * Under TLSF this is a good fit rather than a best fit (see tl_findFit).
  */
-chunk *fl_findBestFit(chunk *l, int targetPayload)
-// pre: l is a list of free chunks, targetPayload is minimum required payload size
-// post: returns the "best" chunk in free list
+chunk *fl_findBestFit(arena *a, int targetPayload)
+// pre: targetPayload is minimum required payload size
+// post: returns the "best" free chunk, or 0 if no free chunk is big enough
 {  
-  
-  chunk *bestSoFar = l; //best so far starts out pointing to dummy node
-  chunk *p = l->next; 
-  int excess = 0;
-  int bestExcess = 0;
-  
-  //iterate through FreeList to find closest matching chunk
-  while (p != l) {
-    if (ck_payloadSize(p) < targetPayload) { 
-      p = p->next; 
-      
-      //If exact match, return immediately; otherwise keep looking
-    } else if (ck_payloadSize(p) == targetPayload) { 
-      return p; 
-      
-      //current payload > targetPayload so there's room for splitting
-    } else { 
-      excess = ck_payloadSize(p) - targetPayload; 
-      
-      if(!bestExcess || excess < bestExcess) { //if we haven't found a best chunk yet or if current free chunk does better 
-	bestExcess = ck_payloadSize(bestSoFar) - targetPayload; //excess of best so far	  
-	bestSoFar = p;//found a better match; update bestSoFar	  	 
-	p = p->next;
-	  
-      } else { //current free chunk does the same or worse than bestSoFar
-	p = p->next;
-      }
-    }
-    return bestSoFar; //return a pointer to the proper chunk, NOT payload
+  if (targetPayload < H_MINPAYLOAD) targetPayload = H_MINPAYLOAD;
+  int size = ck_request(targetPayload); // see ck_split
+  if (UseTlsf) return tl_findFit(a, size);
+  if (size >= H_TREEMIN) return (chunk*)tr_findBest(a, size);
+  int b = fl_bin(size);
+
+  if (b >= H_NSMALL) { // log-spaced bin: chunks here may still be too small
+    chunk *c = fl_bestInBin(a, b, size);
+    if (c) return c;
+    b++;
   }
-  
-  //if nothing matches at all, bestSoFar points to dummy node
-  return bestSoFar;
+  b = fl_nextBin(a, b);
+  if (b < 0) return (chunk*)tr_findBest(a, size);
+  if (b < H_NSMALL) return a->bins[b].next; // every chunk in an exact bin is equal
+  return fl_bestInBin(a, b, size);     // every chunk here fits; find the tightest
 }
 
 /**
- * PUBLIC METHODS.
+ * Tree methods.
+ * A red-black tree of large free chunks keyed by size, with null leaves.
  **/
+#define tr_isRed(t) ((t) && (t)->color == H_RED)
+
 /*
- * hmalloc(size).
- * Allocate and return memory to hold size bytes.
+ * tr_rotate(a,x,left).
+ * Rotate the subtree rooted at x left (or right, if left is 0).
  */
-void *hmalloc(int size)
-{  
+void tr_rotate(arena *a, tchunk *x, int left)
+// pre: x has a child on the side that moves up
+// post: that child takes x's place; x becomes its child
+{
+  tchunk *y = left ? x->right : x->left;
+  tchunk *inner = left ? y->left : y->right;
+  if (left) x->right = inner; else x->left = inner;
+  if (inner) inner->parent = x;
+  tr_replace(a, x, y);
+  if (left) y->left = x; else y->right = x;
+  x->parent = y;
+}
+
+/*
+ * tr_replace(a,u,v).
+ * Hang subtree v (possibly empty) where u hangs from its parent.
+ */
+void tr_replace(arena *a, tchunk *u, tchunk *v)
+// pre: u is in the tree
+// post: u's parent (or a->treeRoot) points at v instead
+{
+  tchunk *p = u->parent;
+  if (!p) a->treeRoot = v;
+  else if (p->left == u) p->left = v;
+  else p->right = v;
+  if (v) v->parent = p;
+}
+
+/*
+ * tr_insert(a,t).
+ * Add free chunk t to the tree, or to the ring of a node of equal size.
+ */
+void tr_insert(arena *a, tchunk *t)
+// pre: t is a free chunk of at least H_TREEMIN bytes, not in any list
+// post: t is in the tree; the tree is balanced
+{
+  int size = ck_size((chunk*)t);
+  tchunk *p = 0;
+  tchunk *n = a->treeRoot;
+  while (n) {
+    int ns = ck_size((chunk*)n);
+    if (ns == size) { // same size: join n's ring
+      t->color = H_CHAINED;
+      t->prev = (chunk*)n;
+      t->next = n->next;
+      n->next->prev = (chunk*)t;
+      n->next = (chunk*)t;
+      return;
+    }
+    p = n;
+    n = size < ns ? n->left : n->right;
+  }
+  t->prev = t->next = (chunk*)t;
+  t->left = t->right = 0;
+  t->parent = p;
+  t->color = H_RED;
+  if (!p) a->treeRoot = t;
+  else if (size < ck_size((chunk*)p)) p->left = t;
+  else p->right = t;
+
+  // restore the red-black properties on the way up
+  while (tr_isRed(t->parent)) {
+    p = t->parent;
+    tchunk *g = p->parent; // exists: a red node is never the root
+    int pLeft = (p == g->left);
+    tchunk *u = pLeft ? g->right : g->left;
+    if (tr_isRed(u)) { // recolor and move up
+      p->color = u->color = H_BLACK;
+      g->color = H_RED;
+      t = g;
+    } else {
+      if (t == (pLeft ? p->right : p->left)) { // inner grandchild
+	t = p;
+	tr_rotate(a, t, pLeft);
+	p = t->parent;
+      }
+      p->color = H_BLACK;
+      g->color = H_RED;
+      tr_rotate(a, g, !pLeft);
+    }
+  }
+  a->treeRoot->color = H_BLACK;
+}
+
+/*
+ * tr_remove(a,t).
+ * Take free chunk t out of the tree.
+ * Chained chunks are simply unlinked; a node with a non-empty ring hands
+ * its place in the tree to the next chunk of the same size.
+ */
+void tr_remove(arena *a, tchunk *t)
+// pre: t is in the tree
+// post: t is removed; the tree is balanced
+{
+  if (t->color == H_CHAINED || t->next != (chunk*)t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    if (t->color == H_CHAINED) return;
+    tchunk *r = (tchunk*)t->next; // successor node of this size
+    r->left = t->left;
+    r->right = t->right;
+    r->color = t->color;
+    if (r->left) r->left->parent = r;
+    if (r->right) r->right->parent = r;
+    tr_replace(a, t, r);
+    return;
+  }
+
+  tchunk *x, *xp; // x (possibly null) replaces the removed black node
+  int color = t->color;
+  if (!t->left || !t->right) {
+    x = t->left ? t->left : t->right;
+    xp = t->parent;
+    tr_replace(a, t, x);
+  } else {
+    tchunk *y = t->right; // t's in-order successor takes its place
+    while (y->left) y = y->left;
+    color = y->color;
+    x = y->right;
+    if (y->parent == t) {
+      xp = y;
+    } else {
+      xp = y->parent;
+      tr_replace(a, y, x);
+      y->right = t->right;
+      y->right->parent = y;
+    }
+    tr_replace(a, t, y);
+    y->left = t->left;
+    y->left->parent = y;
+    y->color = t->color;
+  }
+  if (color == H_RED) return;
+
+  // x carries an extra black; push it up or resolve it by rotation
+  while (x != a->treeRoot && !tr_isRed(x)) {
+    int xLeft = (x == xp->left);
+    tchunk *w = xLeft ? xp->right : xp->left; // exists: x's side is short
+    if (tr_isRed(w)) {
+      w->color = H_BLACK;
+      xp->color = H_RED;
+      tr_rotate(a, xp, xLeft);
+      w = xLeft ? xp->right : xp->left;
+    }
+    if (!tr_isRed(w->left) && !tr_isRed(w->right)) {
+      w->color = H_RED;
+      x = xp;
+      xp = x->parent;
+    } else {
+      if (!tr_isRed(xLeft ? w->right : w->left)) {
+	(xLeft ? w->left : w->right)->color = H_BLACK;
+	w->color = H_RED;
+	tr_rotate(a, w, !xLeft);
+	w = xLeft ? xp->right : xp->left;
+      }
+      w->color = xp->color;
+      xp->color = H_BLACK;
+      (xLeft ? w->right : w->left)->color = H_BLACK;
+      tr_rotate(a, xp, xLeft);
+      x = a->treeRoot;
+    }
+  }
+  if (x) x->color = H_BLACK;
+}
+
+/*
+ * tr_findBest(a,size).
+ * Find the smallest free chunk in the tree holding at least size bytes.
+ */
+tchunk *tr_findBest(arena *a, int size)
+// pre: size is a chunk size
+// post: returns a best-fitting chunk (preferring one off a ring, which is
+//       cheaper to remove), or 0 if no chunk in the tree is big enough
+{
+  tchunk *best = 0;
+  tchunk *n = a->treeRoot;
+  while (n) {
+    int ns = ck_size((chunk*)n);
+    if (ns == size) {
+      best = n;
+      break;
+    }
+    if (ns > size) {
+      best = n;
+      n = n->left;
+    } else {
+      n = n->right;
+    }
+  }
+  return best ? (tchunk*)best->next : 0;
+}
+
+/**
+ * TLSF methods.
+ * Selected with HEAP_FIT=tlsf; every operation here is O(1).
+ **/
+/*
+ * tl_mapping(size,&fl,&sl).
+ * Compute the first- and second-level indices of the list holding size.
+ */
+void tl_mapping(int size, int *fl, int *sl)
+// pre: size is a chunk size
+// post: *fl and *sl index the Tlsf list whose range contains size
+{
+  if (size < H_TLSMALL) {
+    *fl = 0;
+    *sl = size/(H_TLSMALL/H_TLSL);
+  } else {
+    int lg = 31 - __builtin_clz(size);
+    *sl = (size >> (lg - H_TLSLLOG)) ^ H_TLSL; // drop the leading one
+    *fl = lg - H_TLSHIFT + 1;
+  }
+}
+
+/*
+ * tl_insert(a,c).
+ * Push free chunk c on the head of its TLSF list.
+ */
+void tl_insert(arena *a, chunk *c)
+// pre: c not in a list
+// post: c is in its list, and both bitmaps show the list as non-empty
+{
+  int f, s;
+  tl_mapping(ck_size(c), &f, &s);
+  chunk *l = &a->tlsf[f][s];
+  c->prev = l;
+  c->next = l->next;
+  l->next->prev = c;
+  l->next = c;
+  a->tlsfFL |= 1U << f;
+  a->tlsfSL[f] |= 1U << s;
+}
+
+/*
+ * tl_remove(a,c).
+ * Unlink c from its TLSF list, clearing bitmap bits if the list empties.
+ */
+void tl_remove(arena *a, chunk *c)
+// pre: c is in a Tlsf list
+// post: c is removed from that list
+{
+  c->prev->next = c->next;
+  c->next->prev = c->prev;
+  if (c->prev == c->next && c->prev->header == 0) { // only the dummy is left
+    int f, s;
+    tl_mapping(ck_size(c), &f, &s);
+    a->tlsfSL[f] &= ~(1U << s);
+    if (!a->tlsfSL[f]) a->tlsfFL &= ~(1U << f);
+  }
+}
+
+/*
+ * tl_findFit(a,size).
+ * Find a free chunk of at least size bytes in constant time.
+ * The request is rounded up to the start of the next second-level range,
+ * so every chunk in the list found is big enough and only its head is used.
+ */
+chunk *tl_findFit(arena *a, int size)
+// pre: size is a chunk size
+// post: returns a free chunk of at least size bytes, or 0 if none exists
+{
+  if (size >= H_TLSMALL) {
+    size += (1 << (31 - __builtin_clz(size) - H_TLSLLOG)) - 1;
+  }
+  int f, s;
+  tl_mapping(size, &f, &s);
+  if (f >= H_TLFL) return 0;
+  unsigned slMap = a->tlsfSL[f] & (~0U << s);
+  if (!slMap) { // nothing left at this level; try larger ranges
+    unsigned flMap = f+1 < H_TLFL ? a->tlsfFL & (~0U << (f+1)) : 0;
+    if (!flMap) return 0;
+    f = __builtin_ctz(flMap);
+    slMap = a->tlsfSL[f];
+  }
+  s = __builtin_ctz(slMap);
+  return a->tlsf[f][s].next;
+}
+
+/**
+ * Shared heap methods.
+ * These do the real work of hmalloc and hfree; callers must hold a->lock.
+ **/
+/*
+ * heap_alloc(a,size).
+ * Carve a chunk with at least size bytes of payload out of the free lists.
+ */
+chunk *heap_alloc(arena *a, int size)
+// pre: a->lock is held
+// post: returns an allocated (not free) chunk, growing the heap if necessary
+//       or 0 if the heap can't grow
+{
   /*
-   Look through free list to see if there's a chunk big enough to suit your needs (size). If no, grows by at least size. Returns the pointer to the beginning of the whole payload area, not the header; to preserve header info
+   Look through free list to see if there's a chunk big enough to suit your needs (size). If no, grows by at least size.
    */
-  init();
-  
   if (size < H_MINPAYLOAD) {
     size = H_MINPAYLOAD;
   }
+  if (size <= H_SLABMAX && SlabBase) {
+    chunk *o = sl_alloc(a, size);
+    if (o) return o;
+  }
+  int need = ck_request(size); // chunk size, see ck_split
+  if (need <= H_FASTMAX && a->fast[need/H_ALIGN]) { // exact fit, still marked allocated
+    chunk *c = a->fast[need/H_ALIGN];
+    a->fast[need/H_ALIGN] = c->next;
+    a->fastBytes -= need;
+    return c;
+  }
   
-  chunk *found = fl_findBestFit(FreeList, size);
-  if (found->header == 0) { //if dummy
-    found = grow(size, FreeList); //we know if we got to this point nothing in freelist fit
-                                  //chunk we allocate in grow is the one we want to grab
+  chunk *found = fl_findBestFit(a, size);
+  if (!found && need > H_FASTMAX && a->fastBytes) { // large miss: merge fast bins
+    ar_consolidate(a);
+    found = fl_findBestFit(a, size);
+  }
+  if (!found) {
+    found = grow(a, size); //we know if we got to this point nothing in the bins fit
+                           //chunk we allocate in grow is the one we want to grab
+    if (!found) return 0;
+  }
+  fl_remove(a, found);
+  a->zeroLo = a->zeroHi = 0;
+  if (ck_size(found) >= H_PURGEMIN && ((tchunk*)found)->purged == H_ZEROED) {
+    pg_range(found, &a->zeroLo, &a->zeroHi); // ck_split writes outside it
+  }
+  if (!ck_split(a, found, size)) { //remainder (if any) goes back into the bins
+    ck_setInfo(found, found->header & ~H_FREE);
+  }
+  return found;
+}
+
+/*
+ * heap_free(a,c).
+ * Mark chunk c free, coalesce it with free neighbors and put the result
+ * back in the free lists.  (Slab objects go back to their slab, and small
+ * chunks go in a fast bin for now.)
+ */
+void heap_free(arena *a, chunk *c)
+// pre: a->lock is held, c is an allocated chunk of arena a
+// post: c is free
+{
+  if (SL_OWNS(c)) {
+    sl_free(a, c);
+    return;
+  }
+  if (debug) ck_print(c); //this is the chunk being freed      
+  int size = ck_size(c);
+  if (size <= H_FASTMAX) { // defer coalescing
+    c->next = a->fast[size/H_ALIGN];
+    a->fast[size/H_ALIGN] = c;
+    a->fastBytes += size;
+    if (a->fastBytes > H_FASTLIMIT) ar_consolidate(a);
+    return;
+  }
+  ck_setInfo(c, c->header|H_FREE); //reset the flag bits to free
+  heap_release(a, c);
+}
+
+/*
+ * heap_release(a,c).
+ * Coalesce free chunk c with free neighbors and put the result back in
+ * the free lists, then give memory back as the policies allow.
+ */
+void heap_release(arena *a, chunk *c)
+// pre: a->lock is held, c is marked free but is in no list
+// post: c is in the free lists (merged), or released with its segment
+{
+  c = ck_coalesce(a, c);
+  pg_mark(c, H_DIRTY);
+  fl_insert(a, c);
+  // first in its segment (see H_PREVFREE) and last, so it fills it
+  int fills = (c->header & H_PREVFREE) && *(info*)PTR_ADD(c, -H_IS) == 0 &&
+    ck_size((chunk*)PTR_ADD(c, ck_size(c))) == 0;
+  if (fills && sg_release(a, c)) return; // c and its segment are gone
+  if (ck_size(c) > TrimThreshold) hp_trim(a, gr_step(a)); // if c is at the top
+  if (a->dirty && ++a->ticks >= H_PURGETICK) {
+    a->ticks = 0;
+    pg_run(a, H_PURGEBATCH);
+  }
+}
+
+/*
+ * heap_resize(a,c,size).
+ * Resize allocated chunk c in place to hold size bytes.
+ * Growth absorbs a free successor and, at the top of the heap, fresh space;
+ * any excess tail is split off and freed.
+ */
+int heap_resize(arena *a, chunk *c, int size)
+// pre: a->lock is held, c is an allocated (non-slab) chunk of arena a
+// post: returns 1 if c now holds size bytes, or 0 (c unchanged) if it can't
+{
+  if (size < H_MINPAYLOAD) {
+    size = H_MINPAYLOAD;
+  }
+  int need = ck_request(size); // chunk size, see ck_split
+  int have = ck_size(c);
+  if (need > have) {
+    chunk *next = (chunk*)PTR_ADD(c, have);
+    int avail = have;
+    info *top = (info*)PTR_ADD(c, have);
+    if (next->header & H_FREE) {
+      avail += ck_size(next);
+      top = (info*)PTR_ADD(next, ck_size(next));
+    }
+    if (avail < need) { // only the last chunk before the top may extend
+      void *hwm = a == &Main ? HWM : a->heap->hwm;
+      if ((*top & H_SIZEMASK) != 0 || PTR_ADD(top, H_IS) != hwm) return 0;
+      int delta = ((uintptr_t)hwm + need - avail + GrowUnit-1)/GrowUnit*GrowUnit - (uintptr_t)hwm;
+      if (a != &Main && PTR_DIFF(a->heap->end, hwm) < delta) return 0;
+      void *m = hp_more(a, delta);
+      if (m != PTR_ADD(top, H_IS)) { // not contiguous; keep it as a segment
+	if (m) hp_segment(a, m, delta);
+	return 0;
+      }
+      avail += delta;
+      *(info*)PTR_ADD(top, delta) = 0; // move the top boundary
+      sg_move(a, m, PTR_ADD(m, delta));
+    }
+    if (next->header & H_FREE) fl_remove(a, next);
+    ck_setInfo(c, avail|(c->header & (H_NONMAIN|H_PREVFREE)));
+  }
+  ck_split(a, c, size); // give back the tail, if big enough
+  return 1;
+}
+
+/*
+ * heap_align(a,align,size).
+ * Carve a chunk whose payload is aligned to align and holds size bytes.
+ * A chunk big enough to hold an aligned payload wherever it falls is
+ * allocated; the slack ahead of the aligned payload becomes a free chunk
+ * of its own, and the tail is split off as usual.
+ */
+chunk *heap_align(arena *a, int align, int size)
+// pre: a->lock is held, align is a power of two greater than H_ALIGN
+// post: returns an allocated (non-slab) chunk whose payload is aligned,
+//       or 0 if the heap can't grow
+{
+  if (size < H_MINPAYLOAD) {
+    size = H_MINPAYLOAD;
+  }
+  if (size > INT_MAX - align - 2*H_MINCHUNK) return 0;
+  int req = size + align + H_MINCHUNK; // room for a leading chunk, wherever it falls
+  if (SlabBase && req <= H_SLABMAX) req = H_SLABMAX+1; // slab objects can't be carved
+  chunk *c = heap_alloc(a, req);
+  if (!c) return 0;
+  uintptr_t pay = (uintptr_t)PTR_ADD(c, H_IS);
+  if (pay & (align-1)) {
+    uintptr_t p = (pay + H_MINCHUNK + align-1) & ~(uintptr_t)(align-1);
+    int lead = p - pay; // a multiple of H_ALIGN, at least H_MINCHUNK
+    info flags = c->header & H_NONMAIN;
+    chunk *d = (chunk*)PTR_ADD(c, lead);
+    ck_setInfo(d, (ck_size(c) - lead)|flags); // H_PREVFREE comes with c's footer
+    ck_setInfo(c, lead|H_FREE|flags|(c->header & H_PREVFREE));
+    chunk *m = ck_coalesce(a, c);
+    pg_mark(m, H_DIRTY);
+    fl_insert(a, m);
+    c = d;
+  }
+  ck_split(a, c, size); // give back the tail, if big enough
+  return c;
+}
+
+/*
+ * heap_batch(a,size,n,out).
+ * Allocate up to n chunks of size bytes of payload into out, carving them
+ * side by side from one chunk of up to H_BATCHBYTES at a time (or taking
+ * objects from a's slabs, for slab sizes).
+ */
+int heap_batch(arena *a, int size, int n, void **out)
+// pre: a->lock is held, size <= H_CHUNKMAX
+// post: returns the number of payloads stored in out; fewer than n only
+//       if the heap can't grow
+{
+  int got = 0;
+  if (size <= H_SLABMAX && SlabBase) {
+    chunk *o;
+    while (got < n && (o = sl_alloc(a, size < H_MINPAYLOAD ? H_MINPAYLOAD : size))) {
+      out[got++] = PTR_ADD(o, H_IS);
+    }
+    if (got == n) return got; // else carve chunks
+  }
+  int need = ck_request(size);
+  int most = H_BATCHBYTES/need > 0 ? H_BATCHBYTES/need : 1;
+  while (got < n) {
+    int k = n - got < most ? n - got : most;
+    chunk *c;
+    while (!(c = heap_alloc(a, k*need - H_IS)) && k > 1) k /= 2; // ask for less
+    if (!c) break;
+    if (SL_OWNS(c)) { // a slab object after all; it holds one
+      out[got++] = PTR_ADD(c, H_IS);
+      continue;
+    }
+    info flags = c->header & H_NONMAIN;
+    info prev = c->header & H_PREVFREE;
+    int rest = ck_size(c); // k*need, or a little more if heap_alloc couldn't split
+    while (k-- > 0) {
+      int size_c = k ? need : rest; // the last one takes any excess
+      ck_setInfo(c, size_c|flags|prev);
+      out[got++] = PTR_ADD(c, H_IS);
+      rest -= size_c;
+      prev = 0;
+      c = (chunk*)PTR_ADD(c, size_c);
+    }
+  }
+  return got;
+}
+
+/**
+ * Slab methods.
+ * Slabs are owned by an arena and used under its lock; SlabLock guards only
+ * the shared supply of unused slabs.
+ **/
+/*
+ * sl_new(a,size).
+ * Give arena a an empty slab for objects of size bytes.
+ */
+slab *sl_new(arena *a, int size)
+// pre: a->lock is held, size is a multiple of 16, at most H_SLABMAX
+// post: returns a slab at the head of a's partial list for size,
+//       or 0 if the slab range is used up
+{
+  pthread_mutex_lock(&SlabLock);
+  slab *s = SlabFree;
+  if (s) {
+    SlabFree = s->next;
+  } else if (SlabTop < SlabEnd) {
+    s = (slab*)SlabTop;
+    SlabTop += H_SLABSIZE;
+  }
+  pthread_mutex_unlock(&SlabLock);
+  if (!s) return 0;
+
+  s->ar = a;
+  s->size = size;
+  s->first = (sizeof(slab)+15)/16*16;
+  s->nobj = s->nfree = (H_SLABSIZE - s->first)/size;
+  int w;
+  for (w = 0; w < H_SLABWORDS; w++) { // one bit per object, all free
+    int n = s->nobj - 64*w;
+    s->map[w] = n >= 64 ? ~0UL : n > 0 ? (1UL << n) - 1 : 0;
+  }
+  s->prev = 0;
+  s->next = a->slabs[size/16-1];
+  if (s->next) s->next->prev = s;
+  a->slabs[size/16-1] = s;
+  return s;
+}
+
+/*
+ * sl_findFree(s).
+ * Find the index of a free object in slab s.
+ * Slabs of small objects have long bitmaps, so those are scanned 128 bits
+ * at a time with SSE2 before ctz picks the bit.
+ */
+int sl_findFree(slab *s)
+// pre: s has a free object
+// post: returns the index of the lowest free object
+{
+  int w = 0;
+#ifdef __SSE2__
+  if (s->nobj > 128) {
+    __m128i zero = _mm_setzero_si128();
+    while (w+2 <= H_SLABWORDS) {
+      __m128i v = _mm_load_si128((__m128i*)&s->map[w]);
+      if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xFFFF) break;
+      w += 2;
+    }
+  }
+#endif
+  while (!s->map[w]) w++;
+  return 64*w + __builtin_ctzl(s->map[w]);
+}
+
+/*
+ * sl_alloc(a,size).
+ * Allocate an object of at least size bytes from one of a's slabs.
+ */
+chunk *sl_alloc(arena *a, int size)
+// pre: a->lock is held, size <= H_SLABMAX
+// post: returns the object, posing as the chunk H_IS bytes before it,
+//       or 0 if no slab can be had
+{
+  size = (size + 15)/16*16;
+  slab *s = a->slabs[size/16-1];
+  if (!s && !(s = sl_new(a, size))) return 0;
+  int i = sl_findFree(s);
+  s->map[i/64] &= ~(1UL << (i%64));
+  if (!--s->nfree) { // full: off the partial list
+    a->slabs[size/16-1] = s->next;
+    if (s->next) s->next->prev = 0;
+  }
+  return (chunk*)PTR_ADD(s, s->first + i*s->size - H_IS);
+}
+
+/*
+ * sl_free(a,c).
+ * Return the object posing as chunk c to its slab.
+ * A slab that becomes entirely free is given back to the shared supply,
+ * with its memory released, unless it is the class's last partial slab.
+ */
+void sl_free(arena *a, chunk *c)
+// pre: a->lock is held, c came from sl_alloc on a
+// post: the object is free
+{
+  char *o = PTR_ADD(c, H_IS);
+  slab *s = SL_OF(o);
+  int cls = s->size/16-1;
+  int i = (o - (char*)s - s->first)/s->size;
+  if (s->map[i/64] & (1UL << (i%64))) {
+    printf("Cannot free an object that's already free\n");
+    return;
+  }
+  s->map[i/64] |= 1UL << (i%64);
+  if (s->nfree++ == 0) { // was full: back on the partial list
+    s->prev = 0;
+    s->next = a->slabs[cls];
+    if (s->next) s->next->prev = s;
+    a->slabs[cls] = s;
+  } else if (s->nfree == s->nobj && (s->prev || s->next)) {
+    if (s->prev) s->prev->next = s->next; else a->slabs[cls] = s->next;
+    if (s->next) s->next->prev = s->prev;
+    madvise(s, H_SLABSIZE, MADV_DONTNEED);
+    pthread_mutex_lock(&SlabLock);
+    s->next = SlabFree;
+    SlabFree = s;
+    pthread_mutex_unlock(&SlabLock);
+  }
+}
+
+/*
+ * bk_usable(m).
+ * Find how many bytes the caller may use at m, which hmalloc returned.
+ */
+size_t bk_usable(void *m)
+// post: returns the payload size of m's chunk, or its slab's object size
+{
+  if (SL_OWNS(m)) return SL_OF(m)->size;
+  chunk *c = (chunk*)PTR_ADD(m, -H_IS);
+  if (c->header & H_MMAP) return mm_base(c) + mm_len(c) - (char*)m; // to the end of the mapping
+  return ck_payloadSize(c);
+}
+
+/**
+ * Segment registry methods.
+ **/
+
+/*
+ * sg_index(p).
+ * Return the index of the last span whose base is at or below p, or -1.
+ */
+static int sg_index(void *p)
+// pre: SegLock is held
+{
+  int lo = 0, hi = NSegs; // answer is lo-1 once lo == hi
+  while (lo < hi) {
+    int mid = (lo + hi)/2;
+    if (Segs[mid].base <= (char*)p) lo = mid+1;
+    else hi = mid;
+  }
+  return lo-1;
+}
+
+/*
+ * sg_add(base,end,a).
+ * Record that [base,end) belongs to arena a (or is a mapped chunk, if a is 0).
+ */
+void sg_add(void *base, void *end, arena *a)
+// post: the span is in Segs, which is grown if full
+{
+  pthread_mutex_lock(&SegLock);
+  if (NSegs == SegCap) {
+    int cap = SegCap ? 2*SegCap : H_SEGINIT;
+    segment *t = Segs ? mremap(Segs, SegCap*sizeof(segment), cap*sizeof(segment), MREMAP_MAYMOVE)
+                      : mmap(0, cap*sizeof(segment), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED) { // unrecorded; only walkers and release miss it
+      pthread_mutex_unlock(&SegLock);
+      return;
+    }
+    Segs = t;
+    SegCap = cap;
+  }
+  int i = sg_index(base) + 1;
+  memmove(&Segs[i+1], &Segs[i], (NSegs-i)*sizeof(segment));
+  Segs[i].base = base;
+  Segs[i].end = end;
+  Segs[i].ar = a;
+  NSegs++;
+  pthread_mutex_unlock(&SegLock);
+}
+
+/*
+ * sg_remove(base).
+ * Forget the span starting at base.
+ */
+void sg_remove(void *base)
+{
+  pthread_mutex_lock(&SegLock);
+  int i = sg_index(base);
+  if (i >= 0 && Segs[i].base == (char*)base) {
+    memmove(&Segs[i], &Segs[i+1], (NSegs-i-1)*sizeof(segment));
+    NSegs--;
+  }
+  pthread_mutex_unlock(&SegLock);
+}
+
+/*
+ * sg_find(p,s).
+ * Find the span holding address p.
+ */
+int sg_find(void *p, segment *s)
+// post: returns 1 and copies the span to *s, or returns 0 if the heap doesn't own p
+{
+  pthread_mutex_lock(&SegLock);
+  int i = sg_index(p);
+  int found = i >= 0 && (char*)p < Segs[i].end;
+  if (found) *s = Segs[i];
+  pthread_mutex_unlock(&SegLock);
+  return found;
+}
+
+/*
+ * sg_move(a,end,nend).
+ * Move the end of a's segment that ends at end to nend.
+ */
+int sg_move(arena *a, void *end, void *nend)
+// pre: nend doesn't overlap another span
+// post: returns 1, or 0 if a has no segment ending at end
+{
+  pthread_mutex_lock(&SegLock);
+  int i = sg_index(PTR_ADD(end, -1));
+  int found = i >= 0 && Segs[i].end == (char*)end && Segs[i].ar == a;
+  if (found) Segs[i].end = nend;
+  pthread_mutex_unlock(&SegLock);
+  return found;
+}
+
+/*
+ * sg_release(a,c).
+ * Give a segment that has become entirely free back to the system, as far
+ * as its kind allows: a non-main arena unmaps a region other than its newest
+ * (or the one holding the arena), sbrk segments at the break are returned
+ * with sbrk, and others have their pages purged at once.  Main's reservation
+ * has only the one segment, which trimming looks after.
+ */
+int sg_release(arena *a, chunk *c)
+// pre: a->lock is held, c is free, in a's lists, and fills its segment
+// post: returns 1 if c and its segment are gone, 0 if they remain
+{
+  void *base = PTR_ADD(c, -H_LEAD);
+  void *end = PTR_ADD(c, ck_size(c) + H_IS);
+  if (a != &Main) {
+    hheap *h = (hheap*)((uintptr_t)c & ~(uintptr_t)(H_HEAPMAX-1));
+    if (h == a->heap || HP_ARENA(h) == a) return 0;
+    hheap **p = &a->heap;
+    while (*p != h) p = &(*p)->prev;
+    *p = h->prev;
+    fl_remove(a, c);
+    sg_remove(base);
+    munmap(h, H_HEAPMAX);
+    return 1;
+  } else if (!MainEnd && end == HWM && sbrk(0) == HWM) {
+    fl_remove(a, c);
+    sg_remove(base);
+    sbrk(-PTR_DIFF(end, base));
+    HWM = base; // then back down to our highest remaining segment
+    pthread_mutex_lock(&SegLock);
+    int i;
+    for (i = 0; i < NSegs; i++) {
+      if (Segs[i].ar == &Main && Segs[i].end > (char*)HWM) HWM = Segs[i].end;
+    }
+    if (HWM == base) HWM = BASE;
+    pthread_mutex_unlock(&SegLock);
+    return 1;
+  } else if (!MainEnd && ck_size(c) >= H_PURGEMIN && ((tchunk*)c)->purged != H_ZEROED) {
+    char *lo, *hi;
+    fl_remove(a, c);
+    pg_range(c, &lo, &hi);
+    if (hi > lo) {
+      madvise(lo, hi-lo, PurgeAdvice);
+      a->purged += hi-lo;
+    }
+    pg_mark(c, PurgeAdvice == MADV_DONTNEED ? H_ZEROED : H_LAZY);
+    fl_insert(a, c);
+  }
+  return 0;
+}
+
+/**
+ * Mapped chunk methods.
+ **/
+
+/*
+ * mm_length(size,lead).
+ * Return the length of a mapping for a chunk holding size bytes of payload
+ * that starts at most lead bytes in.
+ */
+size_t mm_length(size_t size, size_t lead)
+// post: returns a multiple of PAGE_SIZE; of H_HUGEPAGE if huge pages are
+//       in use and it is at least that large; 0 if it would overflow
+{
+  if (size > SIZE_MAX/2 - lead) return 0;
+  size_t len = (size + lead + PAGE_SIZE-1)/PAGE_SIZE*PAGE_SIZE;
+  if (HugePages && len >= H_HUGEPAGE) len = (len + H_HUGEPAGE-1)/H_HUGEPAGE*H_HUGEPAGE;
+  return len;
+}
+
+/*
+ * mm_base(c).
+ * Return the start of mapped chunk c's mapping.
+ */
+char *mm_base(chunk *c)
+{
+  return PTR_ADD(c, -*(info*)PTR_ADD(c, -H_IS));
+}
+
+/*
+ * mm_len(c).
+ * Return the length of mapped chunk c's mapping.
+ */
+size_t mm_len(chunk *c)
+{
+  return *(size_t*)PTR_ADD(c, -H_LEAD);
+}
+
+/*
+ * mm_alloc(size,align).
+ * Map a chunk of its own to hold size bytes, aligned to align.
+ */
+chunk *mm_alloc(size_t size, size_t align)
+// pre: align is a power of two, at least H_ALIGN
+// post: returns an allocated chunk marked H_MMAP, or 0 if mmap fails
+{
+  size_t lead = align > H_ALIGN ? align + H_ALIGN : H_ALIGN; // room to align the payload
+  size_t len = mm_length(size, lead);
+  if (!len) return 0;
+  char *m = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (UseHugetlb && len % H_HUGEPAGE == 0) {
+    m = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if (m == MAP_FAILED && HugePages && len % H_HUGEPAGE == 0) {
+    // over-map so an aligned mapping fits, then unmap the slop
+    char *o = mmap(0, len+H_HUGEPAGE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (o != MAP_FAILED) {
+      m = (char*)(((uintptr_t)o + H_HUGEPAGE-1) & ~(uintptr_t)(H_HUGEPAGE-1));
+      if (m > o) munmap(o, m-o);
+      munmap(m+len, o+H_HUGEPAGE-m);
+      hp_advise(m, len);
+    }
+  } else if (m == MAP_FAILED) {
+    m = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+  if (m == MAP_FAILED) return 0;
+  atomic_fetch_add_explicit(&Mapped, len, memory_order_relaxed);
+  sg_add(m, PTR_ADD(m, len), 0);
+  char *pay = (char*)(((uintptr_t)m + H_ALIGN + align-1) & ~(uintptr_t)(align-1));
+  chunk *c = (chunk*)PTR_ADD(pay, -H_IS);
+  *(size_t*)PTR_ADD(c, -H_LEAD) = len;
+  *(info*)PTR_ADD(c, -H_IS) = PTR_DIFF(c, m);
+  c->header = H_MMAP;
+  return c;
+}
+
+/*
+ * mm_free(c).
+ * Unmap mapped chunk c, raising MmapThreshold past it if it is larger.
+ */
+void mm_free(chunk *c)
+// pre: c is an allocated chunk marked H_MMAP
+// post: c's mapping is gone
+{
+  size_t pay = bk_usable(PTR_ADD(c, H_IS));
+  size_t len = mm_len(c);
+  char *m = mm_base(c);
+  if (!MmapFixed && pay >= (size_t)MmapThreshold && pay < H_MMAPMAX) {
+    atomic_store_explicit(&MmapThreshold, pay+1, memory_order_relaxed);
+    if (!TrimFixed) atomic_store_explicit(&TrimThreshold, 2*(pay+1), memory_order_relaxed);
+  }
+  atomic_fetch_sub_explicit(&Mapped, len, memory_order_relaxed);
+  sg_remove(m);
+  munmap(m, len);
+}
+
+/*
+ * mm_resize(c,size).
+ * Resize mapped chunk c to hold size bytes with mremap, which moves
+ * page tables rather than bytes when the mapping can't grow in place.
+ * The chunk keeps its offset, but not necessarily its alignment.
+ */
+chunk *mm_resize(chunk *c, size_t size)
+// pre: c is an allocated chunk marked H_MMAP
+// post: returns the (possibly moved) chunk, or 0 with c untouched on failure
+{
+  char *m = mm_base(c);
+  size_t off = PTR_DIFF(c, m);
+  size_t len = mm_len(c);
+  size_t nlen = mm_length(size, off + H_IS);
+  if (nlen == len) return c;
+  if (!nlen) return 0;
+  char *n = mremap(m, len, nlen, MREMAP_MAYMOVE);
+  if (n == MAP_FAILED) return 0;
+  sg_remove(m);
+  sg_add(n, PTR_ADD(n, nlen), 0);
+  atomic_fetch_add_explicit(&Mapped, nlen - len, memory_order_relaxed);
+  c = (chunk*)PTR_ADD(n, off);
+  *(size_t*)PTR_ADD(c, -H_LEAD) = nlen;
+  return c;
+}
+
+/**
+ * Purge methods.
+ **/
+
+/*
+ * pg_now().
+ * Return the purge clock, in ms.
+ */
+long pg_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec*1000L + ts.tv_nsec/1000000;
+}
+
+/*
+ * pg_mark(c,purged).
+ * Record the state of free chunk c's interior pages, if c is tracked.
+ */
+void pg_mark(chunk *c, int purged)
+// pre: c is free and in no list
+// post: a dirty c is stamped with the current time
+{
+  if (ck_size(c) < H_PURGEMIN) return;
+  tchunk *t = (tchunk*)c;
+  t->purged = purged;
+  if (purged == H_DIRTY && PurgeDecay >= 0) t->stamp = pg_now();
+}
+
+/*
+ * pg_link(a,t).
+ * Add dirty chunk t to the newest end of a's dirty ring.
+ */
+void pg_link(arena *a, tchunk *t)
+// pre: a->lock is held, t is in no ring
+{
+  tchunk *d = a->dirty;
+  if (!d) {
+    a->dirty = t->older = t->newer = t;
   } else {
-    ck_split(found, size);
+    t->newer = d;
+    t->older = d->older;
+    d->older->newer = t;
+    d->older = t;
+  }
+}
+
+/*
+ * pg_unlink(a,t).
+ * Remove t from a's dirty ring.
+ */
+void pg_unlink(arena *a, tchunk *t)
+// pre: a->lock is held, t is in a's dirty ring
+{
+  if (t->newer == t) {
+    a->dirty = 0;
+    return;
+  }
+  t->older->newer = t->newer;
+  t->newer->older = t->older;
+  if (a->dirty == t) a->dirty = t->newer;
+}
+
+/*
+ * pg_range(c,lo,hi).
+ * Find the whole pages (GrowUnits) of free chunk c clear of its metadata.
+ */
+void pg_range(chunk *c, char **lo, char **hi)
+// post: [*lo,*hi) is GrowUnit aligned (so huge pages stay whole) and possibly empty
+{
+  uintptr_t l = (uintptr_t)PTR_ADD(c, sizeof(tchunk));
+  uintptr_t h = (uintptr_t)ck_footerAddr(c);
+  l = (l + GrowUnit-1) & ~(uintptr_t)(GrowUnit-1);
+  h &= ~(uintptr_t)(GrowUnit-1);
+  *lo = (char*)l;
+  *hi = (char*)(h > l ? h : l);
+}
+
+/*
+ * pg_run(a,budget).
+ * Purge a's chunks that have been dirty for PurgeDecay ms, oldest first,
+ * until about budget bytes have been dropped.
+ */
+void pg_run(arena *a, long budget)
+// pre: a->lock is held
+{
+  long now = pg_now();
+  tchunk *t;
+  while ((t = a->dirty) && budget > 0 && now - t->stamp >= PurgeDecay) {
+    pg_unlink(a, t);
+    char *lo, *hi;
+    pg_range((chunk*)t, &lo, &hi);
+    if (hi > lo) {
+      madvise(lo, hi-lo, PurgeAdvice);
+      a->purged += hi-lo;
+      budget -= hi-lo;
+    }
+    t->purged = PurgeAdvice == MADV_DONTNEED ? H_ZEROED : H_LAZY;
+  }
+}
+
+/*
+ * pg_thread(unused).
+ * Background purger (HEAP_PURGE_THREAD): sweep every arena twice per decay.
+ */
+void *pg_thread(void *unused)
+{
+  long ms = PurgeDecay/2 + 1;
+  struct timespec ts = { ms/1000, ms%1000*1000000 };
+  for (;;) {
+    nanosleep(&ts, 0);
+    int n;
+    for (n = 0; n < NArenas; n++) {
+      arena *a = ar_nth(n);
+      if (!a) continue;
+      ar_lock(a);
+      pg_run(a, LONG_MAX);
+      pthread_mutex_unlock(&a->lock);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Thread cache methods.
+ * None of these need a lock on entry; the batch operations take arena locks.
+ **/
+/*
+ * tc_start().
+ * Make this thread's cache usable, registering it to be flushed at exit.
+ */
+int tc_start(void)
+// post: returns 1 if the cache may be used, 0 if the thread is exiting
+{
+  if (TCache.state == TC_NEW) {
+    pthread_setspecific(TcKey, &TCache);
+    TCache.state = TC_LIVE;
+  }
+  return TCache.state == TC_LIVE;
+}
+
+/*
+ * tc_class(size).
+ * Find the cache class a request for size bytes is served from: the class
+ * of the payload heap_alloc would hand out for it, so that freed chunks
+ * come back to the class they were taken from.
+ */
+int tc_class(int size)
+// post: returns a class index, or H_TCLISTS if size isn't cached
+{
+  if (size > H_TCMAX) return H_TCLISTS;
+  if (size < H_MINPAYLOAD) size = H_MINPAYLOAD;
+  int pay = SlabBase ? (size + 15)/16*16 : ck_request(size) - H_IS; // see sl_alloc
+  return pay <= H_TCMAX ? pay/H_PS : H_TCLISTS;
+}
+
+/*
+ * tc_refill(i).
+ * Stock this thread's empty class i with a batch of chunks from its arena.
+ */
+int tc_refill(int i)
+// pre: TCache.list[i] is empty
+// post: returns the number of chunks now cached in class i
+{
+  if (!tc_start()) return 0;
+  arena *a = ar_get();
+  int k;
+  ar_lock(a);
+  for (k = 0; k < H_TCBATCH; k++) {
+    chunk *c = heap_alloc(a, i*H_PS);
+    if (!c) break;
+    c->next = TCache.list[i];
+    TCache.list[i] = c;
+  }
+  pthread_mutex_unlock(&a->lock);
+  TCache.count[i] = k;
+  return k;
+}
+
+/*
+ * tc_flush(i,n).
+ * Return up to n chunks from this thread's class i to their arenas.
+ * The cache mixes chunks of any arena, so the lock is switched as needed.
+ */
+void tc_flush(int i, int n)
+// post: class i holds n fewer chunks (or none)
+{
+  chunk *c = TCache.list[i];
+  arena *held = 0;
+  while (c && n--) {
+    chunk *next = c->next;
+    arena *a = ar_of(c);
+    if (a != held) {
+      if (held) pthread_mutex_unlock(&held->lock);
+      ar_lock(a);
+      held = a;
+    }
+    heap_free(a, c);
+    c = next;
+    TCache.count[i]--;
+  }
+  if (held) pthread_mutex_unlock(&held->lock);
+  TCache.list[i] = c;
+}
+
+/*
+ * tc_release(tc).
+ * Thread-exit destructor: flush the exiting thread's whole cache.
+ */
+void tc_release(void *tc)
+// pre: tc is the exiting thread's TCache
+// post: all its chunks are back in the heap; later frees bypass the cache
+{
+  int i;
+  (void)tc;
+  for (i = 0; i < H_TCLISTS; i++) {
+    tc_flush(i, TCache.count[i]);
+  }
+  TCache.state = TC_DEAD;
+}
+
+/**
+ * Per-CPU cache methods.
+ * pc_push and pc_pop are restartable sequences: if the thread is preempted,
+ * migrated or signalled before the committing store, the kernel restarts it
+ * at the abort label, and the C code simply tries again.
+ **/
+#ifdef H_RSEQ
+#define PC_STR(x) PC_XSTR(x)
+#define PC_XSTR(x) #x
+/*
+ * Emit the rseq_cs descriptor for a sequence running from label 1 to
+ * label 2, and point this thread's rseq area at it.
+ */
+#define PC_BEGIN \
+  ".pushsection __rseq_cs, \"aw\"\n\t" \
+  ".balign 32\n\t" \
+  "3:\n\t" \
+  ".long 0x0, 0x0\n\t" \
+  ".quad 1f, (2f - 1f), 4f\n\t" \
+  ".popsection\n\t" \
+  "leaq 3b(%%rip), %%rax\n\t" \
+  "movq %%rax, 8(%[rseq])\n\t" \
+  "1:\n\t" \
+  "cmpl %[cpu], 4(%[rseq])\n\t" \
+  "jnz 4f\n\t"
+/*
+ * The abort handler, preceded by the signature the kernel checks.
+ */
+#define PC_END \
+  "2:\n\t" \
+  ".pushsection __rseq_failure, \"ax\"\n\t" \
+  ".byte 0x0f, 0xb9, 0x3d\n\t" \
+  ".long " PC_STR(RSEQ_SIG) "\n\t" \
+  "4:\n\t" \
+  "jmp %l[abort]\n\t" \
+  ".popsection\n\t"
+#endif
+
+/*
+ * pc_start().
+ * Find (or register) this thread's rseq area.
+ */
+int pc_start(void)
+// post: returns 1 if per-CPU caches may be used by this thread
+{
+#ifdef H_RSEQ
+  if (PcState == PC_UNKNOWN) {
+    PcState = PC_NONE;
+    if (__rseq_size) { // glibc registered one for us
+      MyRseq = (struct rseq*)PTR_ADD(__builtin_thread_pointer(), __rseq_offset);
+    } else if (!syscall(__NR_rseq, &OwnRseq, sizeof(OwnRseq), 0, RSEQ_SIG)) {
+      MyRseq = &OwnRseq;
+    }
+    if (MyRseq && (int)MyRseq->cpu_id >= 0 && (int)MyRseq->cpu_id < NCpus) {
+      PcState = PC_LIVE;
+    }
+  }
+  return PcState == PC_LIVE;
+#else
+  return 0;
+#endif
+}
+
+/*
+ * pc_push(i,c).
+ * Push chunk c on the current CPU's class i.
+ */
+int pc_push(int i, chunk *c)
+// pre: pc_start() returned 1
+// post: returns 1 if c was cached, 0 if the class is full
+{
+#ifdef H_RSEQ
+  for (;;) {
+    int cpu = MyRseq->cpu_id;
+    pcpu *pc = &PCpu[cpu];
+    __asm__ __volatile__ goto (
+      PC_BEGIN
+      "movq (%[top]), %%rcx\n\t"
+      "cmpq %[cap], %%rcx\n\t"
+      "jae %l[full]\n\t"
+      "movq %[c], (%[slot], %%rcx, 8)\n\t"
+      "incq %%rcx\n\t"
+      "movq %%rcx, (%[top])\n\t" // commit
+      PC_END
+      :
+      : [rseq] "r" (MyRseq), [cpu] "r" (cpu), [top] "r" (&pc->top[i]),
+	[slot] "r" (pc->slot[i]), [cap] "i" (H_PCCAP), [c] "r" (c)
+      : "rax", "rcx", "memory", "cc"
+      : abort, full);
+    return 1;
+  abort:
+    continue;
+  full:
+    return 0;
+  }
+#else
+  (void)i; (void)c;
+  return 0;
+#endif
+}
+
+/*
+ * pc_pop(i).
+ * Pop a chunk from the current CPU's class i.
+ */
+chunk *pc_pop(int i)
+// pre: pc_start() returned 1
+// post: returns a cached chunk, or 0 if the class is empty
+{
+#ifdef H_RSEQ
+  chunk *c;
+  for (;;) {
+    int cpu = MyRseq->cpu_id;
+    pcpu *pc = &PCpu[cpu];
+    __asm__ __volatile__ goto (
+      PC_BEGIN
+      "movq (%[top]), %%rcx\n\t"
+      "testq %%rcx, %%rcx\n\t"
+      "jz %l[empty]\n\t"
+      "movq -8(%[slot], %%rcx, 8), %%rax\n\t"
+      "movq %%rax, (%[c])\n\t"
+      "decq %%rcx\n\t"
+      "movq %%rcx, (%[top])\n\t" // commit
+      PC_END
+      :
+      : [rseq] "r" (MyRseq), [cpu] "r" (cpu), [top] "r" (&pc->top[i]),
+	[slot] "r" (pc->slot[i]), [c] "r" (&c)
+      : "rax", "rcx", "memory", "cc"
+      : abort, empty);
+    return c;
+  abort:
+    continue;
+  empty:
+    return 0;
+  }
+#else
+  (void)i;
+  return 0;
+#endif
+}
+
+/*
+ * pc_refill(i).
+ * Take a batch of class i chunks from this thread's arena: return one and
+ * cache the rest on the current CPU.
+ */
+chunk *pc_refill(int i)
+// post: returns an allocated chunk with at least i*H_PS payload, or 0
+{
+  chunk *batch[H_TCBATCH];
+  arena *a = ar_get();
+  int k, n;
+  ar_lock(a);
+  for (n = 0; n < H_TCBATCH; n++) {
+    if (!(batch[n] = heap_alloc(a, i*H_PS))) break;
+  }
+  pthread_mutex_unlock(&a->lock);
+  for (k = 1; k < n && pc_push(i, batch[k]); k++) ;
+  if (k < n) { // the CPU filled up under us; give the rest back
+    pthread_mutex_lock(&a->lock);
+    for (; k < n; k++) heap_free(a, batch[k]);
+    pthread_mutex_unlock(&a->lock);
+  }
+  return n ? batch[0] : 0;
+}
+
+/*
+ * pc_flush(i).
+ * Return a batch of the current CPU's class i chunks to their arenas.
+ */
+void pc_flush(int i)
+// post: the current CPU (at the time of each pop) holds fewer chunks
+{
+  chunk *batch[H_TCBATCH];
+  arena *held = 0;
+  int k, n;
+  for (n = 0; n < H_TCBATCH && (batch[n] = pc_pop(i)); n++) ;
+  for (k = 0; k < n; k++) {
+    arena *a = ar_of(batch[k]);
+    if (a != held) {
+      if (held) pthread_mutex_unlock(&held->lock);
+      ar_lock(a);
+      held = a;
+    }
+    heap_free(a, batch[k]);
   }
+  if (held) pthread_mutex_unlock(&held->lock);
+}
 
-  ck_setInfo(found, ck_size(found));
-  fl_remove(found);
+/**
+ * PUBLIC METHODS.
+ **/
+/*
+ * hmalloc(size).
+ * Allocate and return memory to hold size bytes.
+ * Small requests are served from this thread's (or CPU's) cache whenever possible.
+ */
+void *hmalloc(size_t size)
+{  
+  /*
+   Returns the pointer to the beginning of the whole payload area, not the header; to preserve header info
+   */
+  init();
+  chunk *found;
+  
+  int i = size <= H_TCMAX ? tc_class(size) : H_TCLISTS;
+  if (i < H_TCLISTS) {
+    if (UseRseq && pc_start()) { // no lock needed
+      found = pc_pop(i);
+      if (!found) found = pc_refill(i);
+      if (found) return (chunk*)PTR_ADD(found, H_IS); // else fall through to the arena
+    } else if (TCache.list[i] || tc_refill(i)) { // no lock needed
+      found = TCache.list[i];
+      TCache.list[i] = found->next;
+      TCache.count[i]--;
+      return (chunk*)PTR_ADD(found, H_IS);
+    }
+  }
+
+  if (size >= (size_t)atomic_load_explicit(&MmapThreshold, memory_order_relaxed) ||
+      size > H_CHUNKMAX) {
+    found = mm_alloc(size, H_ALIGN);
+    if (found) return (chunk*)PTR_ADD(found, H_IS); // else try the heap
+    if (size > H_CHUNKMAX) return 0; // too big for a heap chunk
+  }
+
+  arena *a = size > H_BIGREQ ? &Main : ar_get();
+  ar_lock(a);
+  found = heap_alloc(a, size);
+  pthread_mutex_unlock(&a->lock);
+  if (!found) found = mm_alloc(size, H_ALIGN); // the arena can't grow
+  if (!found) return 0;
   
   return (chunk*)PTR_ADD(found, H_IS); //return pointer to the payload
 
@@ -398,37 +2770,123 @@ void *hmalloc(int size)
 /*
  * hcalloc(count,size).
  * Allocate, zero, and return array of count elements, each sized size.
+ * Mapped chunks are fresh from the kernel, so already zero, as are the
+ * interiors of chunks carved from fresh or purged free chunks.
+ * Returns 0 if count*size overflows.
  */
-void *hcalloc(int count, int size)
+void *hcalloc(size_t count, size_t size)
 {
   init();
-  int n = count*size;
-  return memset(hmalloc(n),0,n);
+  if (size && count > SIZE_MAX/size) return 0;
+  size_t n = count*size;
+  void *p;
+  if (n <= H_TCMAX || n >= (size_t)MmapThreshold || n > H_CHUNKMAX) {
+    p = hmalloc(n);
+    if (!p || (!SL_OWNS(p) && ((chunk*)PTR_ADD(p, -H_IS))->header & H_MMAP)) return p;
+    return memset(p,0,n);
+  }
+
+  arena *a = n > H_BIGREQ ? &Main : ar_get();
+  ar_lock(a);
+  chunk *found = heap_alloc(a, n);
+  char *lo = a->zeroLo, *hi = a->zeroHi;
+  pthread_mutex_unlock(&a->lock);
+  if (!found) return (found = mm_alloc(n, H_ALIGN)) ? PTR_ADD(found, H_IS) : 0; // already zero
+  p = PTR_ADD(found, H_IS);
+  char *end = PTR_ADD(p, n);
+  if (lo >= end || hi <= (char*)p) return memset(p,0,n);
+  if (lo > (char*)p) memset(p, 0, lo-(char*)p); // clear around the zero pages
+  if (hi < end) memset(hi, 0, end-hi);
+  return p;
 } 
 
 /*
  * hrealloc(p,size)
  * Re-allocate memory pointed to by p to be at least size.
- * No guarantees about optimality.
+ * The block is resized in place when its neighbors allow, and mapped
+ * blocks are remapped; otherwise it is moved, copying only the old contents.
  */
-void *hrealloc(void *p, int size)
+void *hrealloc(void *p, size_t size)
 {
   init();
-  chunk *c = (chunk*)PTR_ADD(p,-H_IS);
-  if (ck_payloadSize(c) < size) {
-    void *q = hmalloc(size);
-    memcpy(q,p,size);
-    hfree(p);
-    return q;
-  } else {
-    return p;
+  if (!p) return hmalloc(size);
+  size_t old = bk_usable(p);
+  if (SL_OWNS(p)) {
+    if (size <= old) return p; // slab objects don't change size
+  } else if (((chunk*)PTR_ADD(p, -H_IS))->header & H_MMAP) {
+    chunk *c = mm_resize((chunk*)PTR_ADD(p, -H_IS), size);
+    if (c) return PTR_ADD(c, H_IS); // no copy needed
+  } else if (size <= H_CHUNKMAX) {
+    chunk *c = (chunk*)PTR_ADD(p, -H_IS);
+    arena *a = ar_of(c);
+    ar_lock(a);
+    int done = heap_resize(a, c, size);
+    pthread_mutex_unlock(&a->lock);
+    if (done) return p;
   }
+  void *q = hmalloc(size);
+  if (!q) return 0;
+  memcpy(q,p,old < size ? old : size);
+  hfree(p);
+  return q;
 } 
 
 
+/*
+ * hmemalign(align,size).
+ * Allocate and return memory to hold size bytes, aligned to align, which
+ * is rounded up to a power of two.
+ * The block is an ordinary one: hfree and hrealloc take it as usual.
+ */
+void *hmemalign(size_t align, size_t size)
+{
+  init();
+  if (align <= H_ALIGN) return hmalloc(size); // always this well aligned
+  if (align > (1 << 30)) return 0;
+  align = 1 << (32 - __builtin_clz(align - 1));
+  if (size >= (size_t)MmapThreshold || size > H_CHUNKMAX) {
+    chunk *found = mm_alloc(size, align);
+    if (found) return PTR_ADD(found, H_IS); // else try the heap
+    if (size > H_CHUNKMAX) return 0; // too big for a heap chunk
+  }
+  arena *a = size > H_BIGREQ ? &Main : ar_get();
+  ar_lock(a);
+  chunk *found = heap_align(a, align, size);
+  pthread_mutex_unlock(&a->lock);
+  if (!found) found = mm_alloc(size, align); // the arena can't grow
+  return found ? PTR_ADD(found, H_IS) : 0;
+}
+
+/*
+ * haligned_alloc(align,size).
+ * Allocate size bytes aligned to align (see aligned_alloc(3)).
+ */
+void *haligned_alloc(size_t align, size_t size)
+{
+  if (align == 0 || (align & (align-1))) return 0; // not a power of two
+  return hmemalign(align, size);
+}
+
+/*
+ * hposix_memalign(p,align,size).
+ * Allocate size bytes aligned to align, storing the block in *p
+ * (see posix_memalign(3)).
+ */
+int hposix_memalign(void **p, size_t align, size_t size)
+// post: returns 0 with *p set, EINVAL for a bad align, or ENOMEM (*p untouched)
+{
+  if (align < H_PS || (align & (align-1))) return EINVAL;
+  void *m = hmemalign(align, size);
+  if (!m) return ENOMEM;
+  *p = m;
+  return 0;
+}
+
 /*
  * hfree(m).
  * Return/recycle heap-allocated memory, m.
+ * Small chunks are pushed on this thread's (or CPU's) cache, flushing some
+ * of it if full.  Under HEAP_REMOTE, other arenas' chunks are queued for them.
  */
 void hfree(void *m)
 //return a chunk or some memory to the free list. reset free bits to free
@@ -437,15 +2895,161 @@ void hfree(void *m)
     
   chunk *theChunk = (chunk*)PTR_ADD(m, -H_IS); 
   
-  if (!(theChunk->header)&H_FREE) { //use bit mask of 0001; if 1, chunk is free
-    ck_print(theChunk); //this is the chunk being freed      
-    int size = ck_size(theChunk); //size of the entire chunk; saved in header info
-    ck_setInfo(theChunk, size|H_FREE); //reset the flag bits to free
-    
-    fl_insert(FreeList, theChunk);
-  } else {
+  segment s;
+  if (debug && !SL_OWNS(m) && !sg_find(m, &s)) { // costs a lock; debugging only
+    printf("Cannot free memory the heap doesn't own\n");
+    return;
+  }
+  if (!SL_OWNS(m) && theChunk->header&H_FREE) { //use bit mask of 0001; if 1, chunk is free
     printf("Cannot free a chunk that's already free\n");
+    return;
+  }
+  if (!SL_OWNS(m) && theChunk->header&H_MMAP) { // has its own mapping
+    mm_free(theChunk);
+    return;
+  }
+
+  arena *a = ar_of(theChunk);
+  if (UseRemote && a != ar_get()) { // another arena's chunk; never block on it
+    ar_pushRemote(a, theChunk);
+    return;
+  }
+
+  size_t pay = bk_usable(m);
+  if (pay <= H_TCMAX && UseRseq && pc_start()) { // no lock needed
+    while (!pc_push(pay/H_PS, theChunk)) pc_flush(pay/H_PS);
+    return;
+  }
+  if (pay <= H_TCMAX && (TCache.state == TC_LIVE || tc_start())) {
+    int i = pay/H_PS;
+    if (TCache.count[i] >= H_TCCOUNT) tc_flush(i, H_TCCOUNT/2);
+    theChunk->next = TCache.list[i]; // no lock needed
+    TCache.list[i] = theChunk;
+    TCache.count[i]++;
+    return;
+  }
+
+  ar_lock(a);
+  heap_free(a, theChunk);
+  pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * hmalloc_batch(size,n,out).
+ * Allocate n blocks of size bytes each, storing them in out.
+ * The blocks are ordinary ones: hfree, hrealloc and hfree_batch take them.
+ */
+int hmalloc_batch(size_t size, int n, void **out)
+// post: returns the number of blocks stored in out; fewer than n only if
+//       memory ran out
+{
+  init();
+  int got = 0;
+  if (size >= (size_t)MmapThreshold || size > H_CHUNKMAX) { // no gain in batching
+    while (got < n && (out[got] = hmalloc(size))) got++;
+    return got;
+  }
+  arena *a = size > H_BIGREQ ? &Main : ar_get();
+  ar_lock(a);
+  got = heap_batch(a, size, n, out);
+  pthread_mutex_unlock(&a->lock);
+  while (got < n && (out[got] = hmalloc(size))) got++; // the arena can't grow
+  return got;
+}
+
+/*
+ * hfree_batch(ptrs,n).
+ * Free the n blocks in ptrs (null ones are skipped).  Blocks that follow
+ * each other in ptrs and in memory are freed as one chunk, and an arena's
+ * lock is held across all of its blocks in a row.
+ */
+void hfree_batch(void **ptrs, int n)
+{
+  init();
+  arena *a = 0; // the arena whose lock is held
+  chunk *run = 0; // first chunk of the run being gathered
+  char *runEnd = 0;
+  int i;
+  for (i = 0; i <= n; i++) {
+    void *m = i < n ? ptrs[i] : 0;
+    chunk *c = m ? (chunk*)PTR_ADD(m, -H_IS) : 0;
+    if (m && !SL_OWNS(m) && c->header & H_FREE) {
+      printf("Cannot free a chunk that's already free\n");
+      continue;
+    }
+    int plain = m && !SL_OWNS(m) && !(c->header & H_MMAP);
+    if (run && (!plain || (char*)c != runEnd || ar_of(c) != a ||
+		PTR_DIFF(runEnd, run) + ck_size(c) > H_CHUNKMAX)) { // the run ends
+      ck_setInfo(run, PTR_DIFF(runEnd, run)|H_FREE|(run->header & (H_NONMAIN|H_PREVFREE)));
+      heap_release(a, run);
+      run = 0;
+    }
+    if (!m) continue;
+    if (!plain && !SL_OWNS(m)) { // a mapped chunk
+      mm_free(c);
+      continue;
+    }
+    arena *b = SL_OWNS(m) ? SL_OF(m)->ar : ar_of(c);
+    if (b != a) {
+      if (a) pthread_mutex_unlock(&a->lock);
+      ar_lock(a = b);
+    }
+    if (!plain) {
+      sl_free(a, c);
+    } else if (run) {
+      a->merges++;
+      runEnd += ck_size(c);
+    } else {
+      run = c;
+      runEnd = PTR_ADD(c, ck_size(c));
+    }
+  }
+  if (a) pthread_mutex_unlock(&a->lock);
+}
+
+/*
+ * hstats(st).
+ * Report statistics, summed over all arenas.
+ */
+void hstats(struct hstat *st)
+{
+  init();
+  int n;
+  memset(st, 0, sizeof(*st));
+  for (n = 0; n < NArenas; n++) {
+    arena *a = ar_nth(n);
+    if (!a) continue;
+    pthread_mutex_lock(&a->lock);
+    st->merges += a->merges;
+    st->purged += a->purged;
+    st->grows += a->grows;
+    st->requested += a->requested;
+    pthread_mutex_unlock(&a->lock);
   }
+  st->mapped = Mapped;
+}
+
+/*
+ * htrim(pad).
+ * Give free memory at the top of every arena back to the system,
+ * keeping pad bytes free in each.  This thread's cache is emptied first.
+ */
+int htrim(int pad)
+{
+  init();
+  int n, released = 0;
+  for (n = 0; n < H_TCLISTS; n++) {
+    if (TCache.count[n]) tc_flush(n, TCache.count[n]);
+  }
+  for (n = 0; n < NArenas; n++) {
+    arena *a = ar_nth(n);
+    if (!a) continue;
+    ar_lock(a);
+    ar_consolidate(a); // fast chunks may sit below the top
+    released |= hp_trim(a, pad < 0 ? 0 : pad);
+    pthread_mutex_unlock(&a->lock);
+  }
+  return released;
 }
 
 /*
@@ -454,7 +3058,8 @@ void hfree(void *m)
  */
 char *hstrdup(char *s)
 {
-  return strcpy((char*)hmalloc(strlen(s)),s);
+  char *d = hmalloc(strlen(s)+1); // room for the terminator
+  return d ? strcpy(d,s) : 0;
 }
 
 /**
@@ -473,8 +3078,9 @@ void ck_print(chunk *c)
   int paySize = ck_payloadSize(c);
   info *foot = ck_footerAddr(c);
   int f = c->header & H_FREE;
-  printf("%schunk @%p, size %d (payload %d), %svalid.",f?"Free ":"Working ",c,size,paySize,(c->header == *foot)?"":"in");
-  if (c->header != *foot) {
+  int ok = !f || c->header == *foot; // only free chunks have footers
+  printf("%schunk @%p, size %d (payload %d), %svalid.",f?"Free ":"Working ",c,size,paySize,ok?"":"in");
+  if (!ok) {
     printf(" (head: %d, foot: %d)\n",c->header,*foot);
   }
   putchar('\n');
@@ -482,36 +3088,89 @@ void ck_print(chunk *c)
 
 /*
  * fl_print().
- * Prints the chunks in the order they're encountered on the free list.
+ * Prints, arena by arena, the chunks in the order they're encountered
+ * in each non-empty bin.
  */
 void fl_print(void)
-// pre: FreeList has been initialized.
-// post: prints chunks appearing on the free list to stdout
+// pre: no arena lock is held by this thread
+// post: prints chunks appearing on the free lists to stdout
 {
   init();
-  int s = fl_size(FreeList);
-  printf("Free list contains %d chunks:\n",s);
-  chunk *p = FreeList->next;
-  int i = 0;
-  while (p != FreeList) {
-    printf(" %d. ",i); ck_print(p);
-    i++;
-    p = p->next;
+  int n;
+  for (n = 0; n < NArenas; n++) {
+    arena *a = ar_nth(n);
+    int b;
+    if (!a) continue;
+    pthread_mutex_lock(&a->lock);
+    printf("Arena %d:\n",n);
+    if (UseTlsf) {
+      for (b = 0; b < H_TLFL*H_TLSL; b++) {
+	chunk *l = &a->tlsf[0][0] + b;
+	chunk *p;
+	int i = 0;
+	if (l->next == l) continue;
+	printf("TLSF list %d.%d contains %d chunks:\n",b/H_TLSL,b%H_TLSL,fl_size(l));
+	for (p = l->next; p != l; p = p->next) {
+	  printf(" %d. ",i++); ck_print(p);
+	}
+      }
+    }
+    for (b = fl_nextBin(a, 0); b >= 0; b = fl_nextBin(a, b+1)) {
+      int s = fl_size(&a->bins[b]);
+      printf("Bin %d contains %d chunks:\n",b,s);
+      chunk *p = a->bins[b].next;
+      int i = 0;
+      while (p != &a->bins[b]) {
+	printf(" %d. ",i); ck_print(p);
+	i++;
+	p = p->next;
+      }
+    }
+    if (a->treeRoot) {
+      printf("Tree contains:\n");
+      tr_print(a->treeRoot, 1);
+    }
+    for (b = 0; b < H_NFAST; b++) {
+      chunk *p;
+      int i = 0;
+      for (p = a->fast[b]; p; p = p->next) {
+	printf(" fast %d. ",i++); ck_print(p);
+      }
+    }
+    pthread_mutex_unlock(&a->lock);
   }
 }
 
 /*
- * hprint()
- * Print out the segment(s) between BASE and HWM.
+ * tr_print(t,depth).
+ * Prints the subtree rooted at t in size order, indented by depth.
+ */
+void tr_print(tchunk *t, int depth)
+// post: prints each node and the chunks on its ring to stdout
+{
+  if (!t) return;
+  tr_print(t->left, depth+1);
+  chunk *p = (chunk*)t;
+  do {
+    printf("%*s%c ", depth, "", p == (chunk*)t ? (t->color == H_RED ? 'R' : 'B') : '+');
+    ck_print(p);
+    p = p->next;
+  } while (p != (chunk*)t);
+  tr_print(t->right, depth+1);
+}
+
+/*
+ * hp_print(p,hwm)
+ * Print out the segment(s) between p and hwm.
  * All allocated and free chunks are described as encountered.
  */
-void hprint(void)
-// post: prints the chunks in the heap between BASE and HWM
+void hp_print(void *p, void *hwm)
+// pre: the arena owning p...hwm is locked
+// post: prints the chunks in the heap between p and hwm
 {
-  init();
-  void *p = BASE;
-  while (p < HWM) {
+  while (p < hwm) {
     // loop across segments
+    p = PTR_ADD(p,H_LEAD-H_IS); // skip to the base dummy
     info i = *(info*)p;
     if (i == 0) { // i should be a dummy (0) info field
       printf("%p: base dummy\n",p);
@@ -526,6 +3185,59 @@ void hprint(void)
   }
 }
 
+/*
+ * sl_print(s)
+ * Print out the occupancy of slab s.
+ */
+void sl_print(slab *s)
+// pre: the arena owning s is locked
+// post: prints a description to stdout, checking the free count against the bitmap
+{
+  int w, n = 0;
+  for (w = 0; w < H_SLABWORDS; w++) {
+    n += __builtin_popcountl(s->map[w]);
+  }
+  printf("%p: slab of %d-byte objects, %d of %d free, %svalid.\n",
+	 s,s->size,s->nfree,s->nobj,n == s->nfree ? "" : "in");
+}
+
+/*
+ * hprint()
+ * Print out the segment(s) of every arena, as recorded in the registry,
+ * then its partially used slabs; and finally the mapped chunks.
+ */
+void hprint(void)
+// pre: no arena lock is held by this thread
+// post: prints the chunks in the heap
+{
+  init();
+  int n, i;
+  for (n = 0; n < NArenas; n++) {
+    arena *a = ar_nth(n);
+    if (!a) continue;
+    pthread_mutex_lock(&a->lock);
+    printf("Arena %d:\n",n);
+    pthread_mutex_lock(&SegLock);
+    for (i = 0; i < NSegs; i++) {
+      if (Segs[i].ar == a) hp_print(Segs[i].base, Segs[i].end);
+    }
+    pthread_mutex_unlock(&SegLock);
+    int c;
+    slab *sl;
+    for (c = 0; c < H_NSLABCLS; c++) {
+      for (sl = a->slabs[c]; sl; sl = sl->next) {
+	sl_print(sl);
+      }
+    }
+    pthread_mutex_unlock(&a->lock);
+  }
+  pthread_mutex_lock(&SegLock);
+  for (i = 0; i < NSegs; i++) {
+    if (!Segs[i].ar) printf("%p: mapped chunk of %ld bytes\n",Segs[i].base,(long)PTR_DIFF(Segs[i].end,Segs[i].base));
+  }
+  pthread_mutex_unlock(&SegLock);
+}
+
 /*
  * A main method used to test each memory allocation function individually
 
@@ -537,13 +3249,13 @@ int main()
   hfree(ip);
   
   printf("--------------------------------------------------------------\n");
-  grow(8, FreeList); //FreeList[1] is actual chunk
-  printf("grow(8, FreeList)\n");
+  grow(&Main, 8);
+  printf("grow(&Main, 8)\n");
   fl_print();
   hprint();
  
   printf("--------------------------------------------------------------\n");
-  chunk *fit = fl_findBestFit(FreeList, 4000);
+  chunk *fit = fl_findBestFit(&Main, 4000);
   fl_print();
   printf("Best fit for payload 4000: %d (size) %d (payload size)\n", fit->header, ck_payloadSize(fit));
 
@@ -555,7 +3267,7 @@ int main()
   printf("------------------------------------------------------\n");
   int *b = (int*)hmalloc(20);
   printf("HMALLOC(20)\n");
-  chunk *nextfit = fl_findBestFit(FreeList, 20);
+  chunk *nextfit = fl_findBestFit(&Main, 20);
   fl_print();
   hprint();
   printf("Best fit for payload 20: %d (size) %d (payload size)\n", nextfit->header, ck_payloadSize(nextfit));  
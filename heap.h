@@ -2,12 +2,29 @@
 // (c) The Great Class of 2015
 #ifndef HEAP_H
 #define HEAP_H
+#include <stddef.h>
 
 // The public entry points.  
 // These all follow the functionality of the common h-free counterparts.
-extern void *hmalloc(int);	   // allocate bytes (see malloc(3))
-extern void *hcalloc(int,int);	   // allocate zeroed bytes (ditto)
-extern void *hrealloc(void*,int);  // re-allocate bytes (ditto)
+extern void *hmalloc(size_t);	   // allocate bytes (see malloc(3))
+extern void *hcalloc(size_t,size_t); // allocate zeroed bytes (ditto)
+extern void *hrealloc(void*,size_t); // re-allocate bytes (ditto)
 extern void  hfree(void *);	   // free bytes (ditto)
+extern int   hmalloc_batch(size_t,int,void**); // allocate n same-sized blocks at once
+extern void  hfree_batch(void**,int); // free n blocks at once
+extern void *hmemalign(size_t,size_t); // allocate aligned bytes (see memalign(3))
+extern void *haligned_alloc(size_t,size_t); // ditto (see aligned_alloc(3))
+extern int   hposix_memalign(void**,size_t,size_t); // ditto (see posix_memalign(3))
 extern char *hstrdup(char *);	   // string duplication (see strdup(3))
+extern int   htrim(int);	   // release free memory at the top (see malloc_trim(3))
+
+// Counters describing the heap's behavior so far.
+struct hstat {
+  long merges;			   // free chunks merged with a free neighbor
+  long mapped;			   // bytes in blocks mapped on their own
+  long purged;			   // free bytes handed back with madvise
+  long grows;			   // times the heap took space from the system
+  long requested;		   // bytes the heap took from the system
+};
+extern void  hstats(struct hstat *); // fill in current statistics
 #endif